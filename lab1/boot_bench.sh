@@ -0,0 +1,86 @@
+#!/bin/bash
+# boot the lab1 kernel in QEMU (TCG, no KVM needed) and time the boot phases:
+#   init exec      printk time of "Run /init as init process"
+#   init start     first marker written by init (syscall/initrd.c)
+#   workload done  marker written once the benchmark in init has finished
+#   wall           host time from starting QEMU until it exits
+# init ends with reboot(2) and QEMU runs with -no-reboot, so every run exits on its own.
+#
+# usage: ./boot_bench.sh [-k bzImage] [-i initrd] [-n runs] [-b full|hello|none] [-a "cmdline"] [-t timeout]
+# one tab-separated line per run, then the min and median of each column
+
+set -e
+cd "$(dirname "$0")"
+
+kernel=syscall/bzImage
+initrd=
+runs=5
+bench=none
+extra=
+timeout=300
+while getopts "k:i:n:b:a:t:" opt; do
+    case $opt in
+    k) kernel=$OPTARG ;;
+    i) initrd=$OPTARG ;;
+    n) runs=$OPTARG ;;
+    b) bench=$OPTARG ;;
+    a) extra=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    *) sed -n 's/^# usage: //p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+if [ -z "$initrd" ]; then
+    make -s -C syscall initrd.cpio.gz
+    initrd=syscall/initrd.cpio.gz
+fi
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+# printk timestamp of the first line matching $1, empty if none
+stamp() {
+    sed -n "s|^\[ *\([0-9]*\.[0-9]*\)\] .*$1.*|\1|p" "$log" | head -n 1
+}
+
+printf "run\tinit exec\tinit start\tworkload done\twall\n"
+results=()
+for ((i = 1; i <= runs; i++)); do
+    start=$(date +%s.%N)
+    status=0
+    timeout "$timeout" qemu-system-x86_64 -kernel "$kernel" -initrd "$initrd" \
+        -append "console=ttyS0 printk.time=1 bench=$bench shutdown=reboot $extra" \
+        -m 256M -nographic -no-reboot -monitor none -serial "file:$log" </dev/null >/dev/null || status=$?
+    end=$(date +%s.%N)
+    tr -d '\r' < "$log" > "$log.tmp" && mv "$log.tmp" "$log"
+    if [ $status -ne 0 ]; then
+        echo "run $i: qemu exited with status $status, log:" >&2
+        tail -n 20 "$log" >&2
+        exit 1
+    fi
+    exec_at=$(stamp "Run /init as init process")
+    init_at=$(stamp "init: start")
+    done_at=$(stamp "init: workload done")
+    wall=$(awk "BEGIN { printf \"%.6f\", $end - $start }")
+    printf -v line "%s\t%s\t%s\t%s\t%s" "$i" "${exec_at:--}" "${init_at:--}" "${done_at:--}" "$wall"
+    echo "$line"
+    results+=("$line")
+done
+
+# min and median per column; a missing value (-) is skipped
+printf "%s\n" "${results[@]}" | awk -F'\t' '
+    function report(name,   c, n, k, j, v, t) {
+        printf "%s", name
+        for (c = 2; c <= 5; c++) {
+            n = 0
+            for (k = 1; k <= NR; k++) if (val[k, c] != "-") v[++n] = val[k, c] + 0
+            for (k = 2; k <= n; k++)
+                for (j = k; j > 1 && v[j - 1] > v[j]; j--) { t = v[j]; v[j] = v[j - 1]; v[j - 1] = t }
+            if (n == 0) printf "\t-"
+            else if (name == "min") printf "\t%.6f", v[1]
+            else printf "\t%.6f", (n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2)
+        }
+        printf "\n"
+    }
+    { for (c = 2; c <= 5; c++) val[NR, c] = $c }
+    END { report("min"); report("median") }'
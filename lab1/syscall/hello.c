@@ -0,0 +1,114 @@
+// kernel side of the lab1 syscalls, written against linux-5.16.18.
+// copy hello.c and hello.h into kernel/, add `obj-y += hello.o` to kernel/Makefile
+// and append to arch/x86/entry/syscalls/syscall_64.tbl:
+//
+//   548	common	hello			sys_hello
+//   549	common	hello_batch		sys_hello_batch
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/syscalls.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+
+#include "hello.h"
+
+static const char msg[] = "Hello, world!\n";
+
+// the message repeated over a page without a break, for HELLO_FILL:
+// chunks of FILL_CHUNK bytes can be copied back to back and the pattern stays continuous
+#define MSG_LEN     (sizeof(msg) - 1)
+#define FILL_CHUNK  (PAGE_SIZE - PAGE_SIZE % MSG_LEN)
+static char fill_page[PAGE_SIZE];
+
+static int __init hello_init(void)
+{
+	size_t off;
+
+	for (off = 0; off < PAGE_SIZE; off++)
+		fill_page[off] = msg[off % MSG_LEN];
+	return 0;
+}
+late_initcall(hello_init);
+
+// returns the number of bytes written, the terminating NUL included.
+// a NULL buf asks for the size that is needed, a short buffer gets -ENOBUFS
+// (a plain -1 in userspace, like before)
+SYSCALL_DEFINE2(hello, char __user *, buf, size_t, len)
+{
+	if (!buf)
+		return sizeof(msg);
+	if (len < sizeof(msg))
+		return -ENOBUFS;
+	if (copy_to_user(buf, msg, sizeof(msg)))
+		return -EFAULT;
+	return sizeof(msg);
+}
+
+// one round trip for many buffers. every buffer must hold the message, otherwise
+// nothing is written and -ENOBUFS is returned; a NULL vec asks for the size.
+// returns the total number of bytes written
+SYSCALL_DEFINE3(hello_batch, const struct iovec __user *, vec,
+		unsigned long, vlen, unsigned int, flags)
+{
+	struct iovec iovstack[UIO_FASTIOV], *iov = iovstack;
+	unsigned long i;
+	long total = 0;
+
+	if (flags & ~HELLO_FILL)
+		return -EINVAL;
+	if (!vec)
+		return sizeof(msg);
+	if (vlen > UIO_MAXIOV)
+		return -EINVAL;
+	if (vlen > UIO_FASTIOV) {
+		iov = kmalloc_array(vlen, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return -ENOMEM;
+	}
+	if (copy_from_user(iov, vec, vlen * sizeof(*iov))) {
+		total = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < vlen; i++) {
+		if (iov[i].iov_len < sizeof(msg)) {
+			total = -ENOBUFS;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < vlen; i++) {
+		char __user *dst = iov[i].iov_base;
+		size_t len = iov[i].iov_len, off = 0;
+
+		if (!(flags & HELLO_FILL)) {
+			if (copy_to_user(dst, msg, sizeof(msg))) {
+				total = -EFAULT;
+				goto out;
+			}
+			total += sizeof(msg);
+			continue;
+		}
+		while (off < len) {
+			size_t n = min_t(size_t, len - off, FILL_CHUNK);
+
+			if (copy_to_user(dst + off, fill_page, n)) {
+				total = -EFAULT;
+				goto out;
+			}
+			off += n;
+			if (fatal_signal_pending(current)) {
+				total = -EINTR;
+				goto out;
+			}
+			cond_resched();
+		}
+		total += len;
+	}
+out:
+	if (iov != iovstack)
+		kfree(iov);
+	return total;
+}
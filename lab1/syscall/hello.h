@@ -0,0 +1,12 @@
+// shared by the kernel side (hello.c) and the init program (initrd.c)
+#ifndef LAB1_HELLO_H
+#define LAB1_HELLO_H
+
+#define __NR_hello          548     // long hello(char *buf, size_t len)
+#define __NR_hello_batch    549     // long hello_batch(const struct iovec *vec, unsigned long vlen, unsigned int flags)
+
+// hello_batch: fill every buffer completely with repetitions of the message,
+// instead of writing it once, to measure copy_to_user() throughput
+#define HELLO_FILL          1
+
+#endif
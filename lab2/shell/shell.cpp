@@ -1,49 +1,257 @@
 #define USE_CUSTOM_HISTORY
 
 #include <map>
+#include <unordered_map>
+#include <new>
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <vector>
 
-#include <fstream>
 #include <sstream>
 #include <iostream>
 
 #include <cctype>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <climits>
 #include <cstring>
 
 #include <pwd.h>
+#include <dirent.h>
+#include <spawn.h>
 #include <fcntl.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
+#define USE_VARARGS             // declare rl_message(const char *, ...)
+#define PREFER_STDARG
 #include <readline/readline.h>  // for GNU Readline
 
+extern char **environ;
+
 #ifndef USE_CUSTOM_HISTORY
 #include <readline/history.h>   // for GNU history
 #else
-std::vector<std::string> history_lines;
-int current_position_in_history = 0;
-void my_readhist(const char *fname);
-int my_writehist(const char *fname);
-int arrow_function(int, int);
+// persistent history: the file as it was at startup is mmap'd and its line index
+// is built lazily, only as far as lookups need it: backwards from the end for the
+// arrow keys and `history N`, forwards from the start for !n.
+// commands of this session are kept in memory and appended to the file right away
+class history_store {
+    const char *map = nullptr;      // snapshot of the history file at startup
+    size_t map_len = 0;
+    std::vector<size_t> starts;     // line offsets in the map, most recent first
+    size_t scanned = 0;             // map[0, scanned) is not indexed yet
+    std::vector<size_t> fronts;     // line offsets in the map, oldest first
+    size_t front_scanned = 0;       // map[front_scanned, map_len) is not indexed yet
+    size_t file_lines = SIZE_MAX;   // lines in the map, SIZE_MAX until known
+    std::vector<std::string> session;
+    int fd = -1;
+    void index_back(size_t count);
+    void index_front(size_t count);
+    size_t file_size();
+    std::string_view line_at(size_t start) const;
+    std::string_view file_line(size_t k) const { return line_at(starts[k]); }
+
+    // trigram -> ascending ids of the entries containing it, for Ctrl-R.
+    // file lines are numbered from the newest one (their position in starts) and
+    // indexed a chunk at a time, only as far back as a search has had to go;
+    // the commands of this session are indexed by append()
+    using trigram_index = std::unordered_map<uint32_t, std::vector<uint32_t>>;
+    trigram_index file_trigrams, session_trigrams;
+    size_t trigrams_indexed = 0;    // file lines [0, trigrams_indexed) from the end
+    bool index_older_trigrams();
+public:
+    void open(const char *fname);
+    void append(std::string_view line);
+    size_t size();
+    bool has(size_t i);
+    bool has_from_end(size_t k);
+    std::string_view from_end(size_t k);    // k = 0 is the most recent entry
+    std::string_view at(size_t i);          // i = 0 is the oldest entry
+    long search(std::string_view query, size_t from);   // in from_end() numbering
+};
+history_store history;
+size_t history_browse = 0;          // how many entries up the arrow keys went
 int arrow_function(int, int);
+int reverse_search_function(int, int);
 #endif
 
-std::string expand_hist(std::string);
+// bump allocator holding the syntax tree of one command line
+// everything is released at once by reset() before the next line is parsed
+class arena {
+    std::vector<char *> blocks;
+    char *cur = nullptr;
+    size_t left = 0;
+    static const size_t BLOCK_SIZE = 64 * 1024;
+public:
+    arena() = default;
+    arena(const arena &) = delete;
+    ~arena() { reset(); }
+    void *alloc(size_t n, size_t align = alignof(std::max_align_t));
+    char *copy(std::string_view s);
+    template <class T> T *make() { return new (alloc(sizeof(T), alignof(T))) T(); }
+    void reset();
+};
+
+struct redirection {
+    enum kind_t { IN, OUT, APPEND, DUP, CLOSE, HEREDOC } kind;
+    int fd;                     // file descriptor in the child
+    const char *target;         // file name, or the body of a heredoc / here-string
+    int source = -1;            // DUP: `fd>&source`
+    redirection *next = nullptr;
+};
+
+struct pipeline;
+
+// `<(cmd)` or `>(cmd)`: the word is replaced by /dev/fd/N,
+// N being one end of a pipe whose other end is cmd's stdout or stdin
+struct substitution {
+    pipeline *body;
+    bool output;                // >(cmd)
+    int fd;                     // N
+    substitution *next = nullptr;
+};
+
+// one stage of a pipeline
+struct command {
+    int argc = 0;
+    char **argv = nullptr;      // nullptr-terminated
+    char **patterns = nullptr;  // per word: its glob pattern, or nullptr; nullptr if no word has one
+    redirection *redirs = nullptr;
+    substitution *substs = nullptr;
+    command *next = nullptr;    // next stage
+};
+
+struct pipeline {
+    command *stages = nullptr;
+    int stage_count = 0;
+    bool background = false;    // terminated by `&`
+    bool timed = false;         // prefixed with `time`
+    std::string_view text;      // source text, for the job table
+    pipeline *next = nullptr;   // next pipeline in a `;` or `&` separated list
+};
+
+struct token {
+    enum kind_t {
+        WORD, PIPE, SEMI, AMP, LESS, GREAT, DGREAT,
+        LESSAND, GREATAND,      // <& >&
+        DLESS, DLESSDASH, TLESS, // << <<- <<<
+        PROCSUB_IN, PROCSUB_OUT, // <(...) >(...)
+        END, ERROR
+    } kind;
+    int io_number = -1;         // the `2` in `2>file`
+    char *word = nullptr;       // unquoted text for WORD, the raw command for PROCSUB_*
+    char *pattern = nullptr;    // WORD with an unquoted * ? or [: the glob, quoted metacharacters escaped
+};
+
+// single pass tokenizer, every word is unquoted straight into the arena
+class lexer {
+    std::string_view in;
+    size_t pos = 0;
+    arena &mem;
+    size_t word_end(bool &ok) const;
+    char *unquote(size_t end, bool as_pattern, bool &glob);
+    token subcommand(token::kind_t kind);
+public:
+    lexer(std::string_view in, arena &mem) : in(in), mem(mem) {}
+    token next();
+    size_t offset() const { return pos; }
+    std::string error;
+};
+
+// supplies the lines that follow the one being parsed, for heredoc bodies
+struct line_source {
+    virtual bool next(std::string &line) = 0;
+};
+
+bool parse(std::string_view line, arena &mem, pipeline *&out, line_source *more = nullptr);
+void expand_globs(pipeline *p, arena &mem);
+
+std::string expand_hist(std::string_view);
+
+std::string_view sanitize(std::string_view);
+
+// command hash table like bash's `hash`: name -> absolute path,
+// so that $PATH is walked once per command instead of on every execvp
+struct hashed_command {
+    std::string path;
+    int hits = 0;
+};
+std::unordered_map<std::string, hashed_command> command_hash;
+bool resolve_command(const char *name, std::string &path);
+void init_spawnattr(posix_spawnattr_t *attr);
+int spawn_command(pid_t *pid, char *const argv[],
+                  const posix_spawn_file_actions_t *actions, const posix_spawnattr_t *attr);
 
-std::string sanitize(std::string);
-std::vector<std::string> split(std::string s, const std::string &delimiter);
+char **complete_line(const char *text, int start, int end);
 
-void fork_and_exec(std::vector<std::string> &args);
-void execute_with_pipe(std::vector<std::string> &args);
+void run_line(std::string_view line, arena &mem, line_source *more);
+int run_script(std::string_view text);
+int run_file(const char *fname);
+bool run_builtin(command *cmd);
+bool is_builtin(const char *name);
+void run_in_shell(pipeline *p);
+void execute_with_pipe(pipeline *p);
+
+// job control
+struct process {
+    pid_t pid;
+    int status = 0;
+    bool completed = false;
+    bool stopped = false;
+    struct rusage usage = {};   // from wait4, once completed
+    struct timespec start = {}, end = {};
+    std::string text;           // argv of the stage, kept for `time` only
+};
+
+struct job {
+    int id;                     // the n in %n
+    pid_t pgid;
+    std::string text;           // command line shown by `jobs`
+    std::vector<process> procs;
+    bool notified = false;      // the user has been told that it stopped
+    bool timed = false;
+    struct timespec start = {};
+    bool has_tmodes = false;
+    struct termios tmodes;      // terminal modes saved when it stopped
+    bool completed() const;
+    bool stopped() const;
+};
+
+std::map<pid_t, job> jobs;      // keyed by process group
+pid_t shell_pgid;
+struct termios shell_tmodes;
+int sigchld_pipe[2] = {-1, -1}; // the SIGCHLD handler wakes up readline through this pipe
+
+void update_process(pid_t pid, int status, const struct rusage &usage);
+void reap_children();
+void wait_for_job(job &j);
+void put_job_in_foreground(job &j, bool cont);
+void notify_jobs();
+void print_job(const job &j);
+job *find_job(const char *spec);
+int exit_code(int status);
+void print_times(const job &j);
+
+void run_parallel(int argc, char **argv);
 
 sigjmp_buf ctrlc_buf;
+// set while a builtin runs in the shell: Ctrl-C then only interrupts the call
+// it blocks in, and the builtin returns normally so its redirections are undone
+volatile sig_atomic_t in_builtin = 0, got_sigint = 0;
 static void sigintHandler(int sig) {
     // Ctrl-C sends SIGINT to the whole process group
     // bash 处理 Ctrl-C 的方法是让子进程 setpgid 脱离进程组。
@@ -57,14 +265,92 @@ static void sigintHandler(int sig) {
     // write(STDERR_FILENO, "Caught SIGINT!\n", 15);
     if (sig == SIGINT) {
         // printf("You pressed Ctrl+C\n");
+        int saved_errno = errno;
         write(STDERR_FILENO, "\n", 1);
+        errno = saved_errno;
+        if (in_builtin) {
+            got_sigint = 1;
+            return;
+        }
         siglongjmp(ctrlc_buf, 1);
     }
 }
 
-int main() {
+static void sigchldHandler(int sig) {
+    int saved_errno = errno;
+    write(sigchld_pipe[1], "c", 1);
+    errno = saved_errno;
+}
+
+// readline blocks in here: besides the terminal, watch the SIGCHLD self-pipe
+// so that background jobs are reaped and reported as soon as they finish
+static int job_aware_getc(FILE *stream) {
+    while (true) {
+        struct pollfd fds[2] = {{fileno(stream), POLLIN, 0}, {sigchld_pipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return EOF;
+        }
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+            reap_children();
+            bool pending = false;
+            for (auto &entry : jobs)
+                pending |= entry.second.completed() || (entry.second.stopped() && !entry.second.notified);
+            if (pending) {
+                // print above the line being edited, then draw it again
+                rl_crlf();
+                notify_jobs();
+                rl_on_new_line();
+                rl_redisplay();
+            }
+        }
+        if (fds[0].revents) {
+            return rl_getc(stream);
+        }
+    }
+}
+
+// heredoc bodies typed at the secondary prompt
+struct prompt_lines : line_source {
+    bool next(std::string &line) override {
+        char *text = readline("> ");
+        if (text == nullptr) return false;
+        line = text;
+        free(text);
+        return true;
+    }
+};
+
+const char *homedir;
+bool interactive = false;   // reading from a terminal with readline and job control
+int last_status = 0;        // exit status of the last pipeline
+
+static void usage() {
+    std::cerr << "usage: shell [-c command | script]" << std::endl;
+    exit(2);
+}
+
+int main(int argc, char **argv) {
     std::ios::sync_with_stdio(false);
 
+    uid_t uid = getuid();
+    struct passwd *pw = getpwuid(uid);
+    homedir = pw->pw_dir;
+
+    if (argc > 1) {
+        if (!strcmp(argv[1], "-c")) {
+            if (argc < 3) usage();
+            return run_script(argv[2]);
+        }
+        return run_file(argv[1]);
+    }
+    if (!isatty(STDIN_FILENO)) {
+        return run_file(nullptr);
+    }
+    interactive = true;
+
     struct sigaction new_action, old_action;
     sigaction(SIGINT, NULL, &old_action);
     old_action.sa_flags &= ~SA_RESTART;     // make getline fail with EINTR on SIGINT
@@ -75,9 +361,25 @@ int main() {
         exit(1);
     }
 
-    uid_t uid = getuid();
-    struct passwd *pw = getpwuid(uid);
-    const char *homedir = pw->pw_dir;
+    // wait until we are in the foreground, then leave the tty signals to the jobs
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+
+    if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    sigaction(SIGCHLD, NULL, &new_action);
+    new_action.sa_handler = sigchldHandler;
+    new_action.sa_flags |= SA_RESTART;
+    sigaction(SIGCHLD, &new_action, NULL);
+    rl_getc_function = job_aware_getc;
+    rl_attempted_completion_function = complete_line;
 
 #ifndef USE_CUSTOM_HISTORY
     using_history();
@@ -85,10 +387,13 @@ int main() {
 #else
     rl_bind_keyseq("\\e[A", arrow_function);
     rl_bind_keyseq("\\e[B", arrow_function);
-    my_readhist("myshell_histfile");
+    rl_bind_keyseq("\\C-r", reverse_search_function);
+    history.open("myshell_histfile");
 #endif
 
     std::string cmd;
+    arena mem;
+    prompt_lines terminal;
     while (true) {
         // std::cout << (uid ? "$ " : "# ") << std::flush;
 
@@ -96,336 +401,1868 @@ int main() {
         // had to resort to GNU readline
         // longjmp is dirty, but ... well, ok
         while (sigsetjmp(ctrlc_buf, 1) != 0);   // copied from stackoverflow https://stackoverflow.com/questions/16828378/readline-get-a-new-prompt-on-sigint
+        reap_children();
+        notify_jobs();
         std::cout << std::flush;                // refrain from flushing everytime (std::endl)
-        current_position_in_history = history_lines.size();
+#ifdef USE_CUSTOM_HISTORY
+        history_browse = 0;
+#endif
         char* line = readline(uid ? "$ " : "# ");
-        if (line == nullptr) cmd = "exit";
-        else cmd = line;
+        if (line == nullptr) {
+            cmd = "exit";
+        } else {
+            cmd = expand_hist(sanitize(line));
+            free(line);
+        }
 
-        cmd = expand_hist(sanitize(cmd));
+        if (cmd.empty()) {
+            continue;
+        }
 #ifndef USE_CUSTOM_HISTORY
         add_history(cmd.c_str());
 #else
-        history_lines.push_back(cmd);
+        history.append(cmd);
 #endif
 
-        // 按空格分割命令为单词
-        // TODO 可以考虑写写 escape magic
-        // example: echo "qwq qwq"|lolcat  ==>  echo, qwq qwq, |, lolcat
-        // std::vector<std::string> args = magic_split(cmd);
-        std::vector<std::string> args = split(cmd, " ");
+        // example: echo "qwq qwq"|lolcat  ==>  [echo, qwq qwq] | [lolcat]
+        run_line(cmd, mem, &terminal);
+    }
+}
 
-        if (args.empty()) {
+void run_line(std::string_view line, arena &mem, line_source *more) {
+    reap_children();
+    mem.reset();
+    pipeline *list;
+    if (!parse(line, mem, list, more)) {
+        last_status = 2;
+        return;
+    }
+    for (pipeline *p = list; p; p = p->next) {
+        if (p->stage_count == 0) {
+            // a bare `time`: nothing ran, all zeros
+            print_times(job());
+            last_status = 0;
             continue;
         }
+        // when it runs, not when parsed: `cd dir; ls *` lists dir
+        expand_globs(p, mem);
+        if (p->stage_count == 1 && is_builtin(p->stages->argv[0])) {
+            run_in_shell(p);
+            continue;
+        }
+        execute_with_pipe(p);
+    }
+}
 
-        if (args[0] == "cd") {
-            if (args.size() <= 1) {
-                args.push_back(homedir);
-            } else if (args[1][0] == '~') {
-                args[1] = std::string(homedir) + std::string(args[1].c_str() + 1);
+// heredoc bodies in a script are the lines right after the command
+struct script_lines : line_source {
+    std::string_view &text;
+    explicit script_lines(std::string_view &text) : text(text) {}
+    std::string_view take() {
+        size_t nl = text.find('\n');
+        std::string_view line = text.substr(0, nl);
+        text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+        return line;
+    }
+    bool next(std::string &line) override {
+        if (text.empty()) return false;
+        line = take();
+        return true;
+    }
+};
+
+// non-interactive mode: no readline, no history, no job control,
+// the lines are taken straight out of one buffer
+int run_script(std::string_view text) {
+    arena mem;
+    script_lines source(text);
+    while (!text.empty()) {
+        std::string_view line = sanitize(source.take());
+        if (line.empty()) continue;
+        reap_children();
+        notify_jobs();
+        run_line(line, mem, &source);
+    }
+    return last_status;
+}
+
+// read a whole script at once: mmap for regular files, big read()s otherwise
+int run_file(const char *fname) {
+    int fd = fname ? open(fname, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd < 0) {
+        std::cerr << "cannot open " << fname << ": " << strerror(errno) << std::endl;
+        return 127;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            if (fname) close(fd);
+            return run_script(std::string_view((const char *)map, st.st_size));
+        }
+    }
+    std::string text;
+    const size_t CHUNK = 1 << 20;
+    while (true) {
+        size_t old_size = text.size();
+        text.resize(old_size + CHUNK);
+        ssize_t len = read(fd, &text[old_size], CHUNK);
+        if (len < 0) {
+            text.resize(old_size);
+            if (errno == EINTR) continue;
+            std::cerr << "read failed: " << strerror(errno) << std::endl;
+            return 127;
+        }
+        text.resize(old_size + len);
+        if (len == 0) break;
+    }
+    if (fname) close(fd);
+    return run_script(text);
+}
+
+const char *const builtin_names[] = {
+    "cd", "pwd", "export", "hash", "jobs", "fg", "bg", "wait", "parallel", "history", "exit",
+};
+
+bool is_builtin(const char *name) {
+    for (const char *n : builtin_names)
+        if (!strcmp(name, n)) return true;
+    return false;
+}
+
+// returns false if cmd is not a builtin
+bool run_builtin(command *cmd) {
+    int argc = cmd->argc;
+    char **argv = cmd->argv;
+    last_status = 0;
+
+    if (!strcmp(argv[0], "cd")) {
+        std::string dir;
+        if (argc <= 1) {
+            dir = homedir;
+        } else if (argv[1][0] == '~') {
+            dir = std::string(homedir) + (argv[1] + 1);
+        } else {
+            dir = argv[1];
+        }
+
+        int ret = chdir(dir.c_str());
+        if (ret < 0) {
+            std::cerr << "cd failed: " << strerror(errno) << '\n';
+            last_status = 1;
+        }
+        return true;
+    } // cd
+
+    if (!strcmp(argv[0], "pwd")) {
+        std::string cwd;
+
+        // 预先分配好空间
+        cwd.resize(PATH_MAX);
+
+        // std::string to char *: &s[0]（C++17 以上可以用 s.data()）
+        // std::string 保证其内存是连续的
+        const char *ret = getcwd(&cwd[0], PATH_MAX);
+        if (ret == nullptr) {
+            std::cout << "cwd failed\n";
+            last_status = 1;
+        } else {
+            std::cout << ret << "\n";
+        }
+        return true;
+    } // pwd
+
+    if (!strcmp(argv[0], "export")) {
+        for (int i = 1; i < argc; i++) {
+            std::string_view arg = argv[i];
+            std::string key(arg);
+            std::string value;
+
+            // std::string::npos = const max size_t
+            size_t pos;
+            if ((pos = arg.find('=')) != std::string_view::npos) {
+                key = arg.substr(0, pos);
+                value = arg.substr(pos + 1);
+            } else {
+                // if it is already assigned as internal variable,
+                //   export the variable
             }
 
-            int ret = chdir(args[1].c_str());
+            int ret = setenv(key.c_str(), value.c_str(), 1);
             if (ret < 0) {
-                std::cerr << "cd failed: " << strerror(errno) << '\n';
+                std::cout << "export failed\n";
+                last_status = 1;
+            } else if (key == "PATH") {
+                command_hash.clear();
             }
-            continue;
-        } // cd
-
-        if (args[0] == "pwd") {
-            std::string cwd;
+        }
+        return true;
+    } // export
 
-            // 预先分配好空间
-            cwd.resize(PATH_MAX);
+    if (!strcmp(argv[0], "hash")) {
+        if (argc <= 1) {
+            if (command_hash.empty()) {
+                std::cout << "hash: hash table empty\n";
+                return true;
+            }
+            printf("hits\tcommand\n");
+            for (auto &entry : command_hash)
+                printf("%4d\t%s\n", entry.second.hits, entry.second.path.c_str());
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "-r")) {
+                command_hash.clear();
+                continue;
+            }
+            std::string path;
+            if (!resolve_command(argv[i], path)) {
+                std::cerr << "hash: " << argv[i] << ": not found\n";
+                last_status = 1;
+            }
+        }
+        return true;
+    } // hash
 
-            // std::string to char *: &s[0]（C++17 以上可以用 s.data()）
-            // std::string 保证其内存是连续的
-            const char *ret = getcwd(&cwd[0], PATH_MAX);
-            if (ret == nullptr) {
-                std::cout << "cwd failed\n";
+    if (!strcmp(argv[0], "jobs")) {
+        reap_children();
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            print_job(it->second);
+            if (it->second.completed()) {
+                if (it->second.timed) print_times(it->second);
+                it = jobs.erase(it);
             } else {
-                std::cout << ret << "\n";
+                ++it;
             }
-            continue;
-        } // pwd
-
-        if (args[0] == "export") {
-            for (auto i = ++args.begin(); i != args.end(); i++) {
-                std::string key = *i;
-                std::string value;
-
-                // std::string::npos = const max size_t
-                size_t pos;
-                if ((pos = i->find('=')) != std::string::npos) {
-                    key = i->substr(0, pos);
-                    value = i->substr(pos + 1);
-                } else {
-                    // if it is already assigned as internal variable,
-                    //   export the variable
-                }
+        }
+        return true;
+    } // jobs
 
-                int ret = setenv(key.c_str(), value.c_str(), 1);
-                if (ret < 0) {
-                    std::cout << "export failed\n";
-                }
+    if (!strcmp(argv[0], "fg") || !strcmp(argv[0], "bg")) {
+        if (!interactive) {
+            std::cerr << argv[0] << ": no job control" << std::endl;
+            last_status = 1;
+            return true;
+        }
+        job *j = find_job(argc > 1 ? argv[1] : nullptr);
+        if (j == nullptr || j->completed()) {
+            std::cerr << argv[0] << ": " << (argc > 1 ? argv[1] : "current") << ": no such job" << std::endl;
+            last_status = 1;
+            return true;
+        }
+        if (argv[0][0] == 'f') {
+            std::cerr << j->text << std::endl;
+            put_job_in_foreground(*j, true);
+        } else {
+            for (process &proc : j->procs) proc.stopped = false;
+            j->notified = false;
+            kill(-j->pgid, SIGCONT);
+            std::cerr << "[" << j->id << "]+ " << j->text << " &" << std::endl;
+        }
+        return true;
+    } // fg, bg
+
+    if (!strcmp(argv[0], "wait")) {
+        // without arguments wait for every running job
+        std::vector<pid_t> targets;
+        for (int i = 1; i < argc; i++) {
+            job *j = nullptr;
+            if (argv[i][0] == '%') {
+                j = find_job(argv[i]);
+            } else {
+                pid_t pid = atoi(argv[i]);
+                for (auto &entry : jobs)
+                    for (process &proc : entry.second.procs)
+                        if (proc.pid == pid) j = &entry.second;
             }
-            continue;
-        } // export
+            if (j == nullptr) {
+                std::cerr << "wait: " << argv[i] << ": no such job" << std::endl;
+                last_status = 127;
+                continue;
+            }
+            targets.push_back(j->pgid);
+        }
+        if (argc <= 1) {
+            for (auto &entry : jobs)
+                if (!entry.second.stopped()) targets.push_back(entry.first);
+        }
+        for (pid_t pgid : targets) {
+            auto it = jobs.find(pgid);
+            if (it == jobs.end()) continue;
+            wait_for_job(it->second);
+            if (got_sigint) {
+                last_status = 128 + SIGINT;
+                break;
+            }
+            if (it->second.completed()) {
+                last_status = exit_code(it->second.procs.back().status);
+                if (it->second.timed) print_times(it->second);
+                jobs.erase(it);
+            }
+        }
+        return true;
+    } // wait
 
-        if (args[0] == "history") {
-            int idx = 0;
-            if (args.size() <= 1) {
-                // show all history
+    if (!strcmp(argv[0], "parallel")) {
+        run_parallel(argc, argv);
+        return true;
+    } // parallel
+
+    if (!strcmp(argv[0], "history")) {
+        int idx = 0;
+        if (argc <= 1) {
+            // show all history
 #ifndef USE_CUSTOM_HISTORY
-                idx = history_length;
+            idx = history_length;
 #else
-                idx = history_lines.size();
+            idx = history.size();
 #endif
-            } else {
-                idx = atoi(args[1].c_str());    // no error checking, sorry xD
-            }
+        } else {
+            idx = atoi(argv[1]);    // no error checking, sorry xD
+        }
 #ifndef USE_CUSTOM_HISTORY
-            HIST_ENTRY **histptr = history_list();
-            for (int i = history_length - idx; i < history_length; ++i) {
-                printf("%5d  %s\n", i+history_base, histptr[i]->line);
-            }
+        HIST_ENTRY **histptr = history_list();
+        for (int i = history_length - idx; i < history_length; ++i) {
+            printf("%5d  %s\n", i+history_base, histptr[i]->line);
+        }
 #else
-            for (int i = history_lines.size() - idx; i < history_lines.size(); ++i) {
-                printf("%5d  %s\n", i+1, history_lines[i].c_str());
-            }
-#endif
-            continue;
+        // the last entries are read from the end, so only they get indexed
+        size_t total = history.size();
+        for (size_t i = total - std::min((size_t)std::max(idx, 0), total); i < total; ++i) {
+            std::string_view line = history.from_end(total - 1 - i);
+            printf("%5zu  %.*s\n", i+1, (int)line.size(), line.data());
         }
+#endif
+        return true;
+    }
 
-        if (args[0] == "exit") {
+    if (!strcmp(argv[0], "exit")) {
 #ifndef USE_CUSTOM_HISTORY
-            if (write_history("myshell_histfile") != 0) {
-#else
-            if (my_writehist("myshell_histfile") != 0) {
+        if (interactive && write_history("myshell_histfile") != 0) {
+            perror("cannot write history file");
+        }
 #endif
-                perror("cannot write history file");
-            }
+        // the custom history has already been appended command by command
 
-            if (args.size() <= 1) {
-                return 0;
-            }
+        if (argc <= 1) {
+            exit(last_status);
+        }
 
-            // std::string 转 int
-            std::stringstream code_stream(args[1]);
-            int code = 0;
-            code_stream >> code;
+        // std::string 转 int
+        std::stringstream code_stream(argv[1]);
+        int code = 0;
+        code_stream >> code;
 
-            // 转换失败
-            if (!code_stream.eof() || code_stream.fail()) {
-                std::cout << "Invalid exit code\n";
-                continue;
+        // 转换失败
+        if (!code_stream.eof() || code_stream.fail()) {
+            std::cout << "Invalid exit code\n";
+            last_status = 2;
+            return true;
+        }
+
+        exit(code);
+    } // exit
+
+    return false;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// `>` truncates: without O_TRUNC a shorter output would leave the tail of the old file
+static int open_flags(redirection::kind_t kind) {
+    switch (kind) {
+    case redirection::IN: return O_RDONLY;
+    case redirection::APPEND: return O_WRONLY | O_CREAT | O_APPEND;
+    default: return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+// everything started for one job: its stages, the commands behind their
+// process substitutions and the writers of large heredocs
+struct launch_state {
+    posix_spawnattr_t attr;
+    pid_t leader = 0;
+    bool foreground = false;
+    bool timed = false;
+    std::vector<process> procs;
+};
+
+// the shell's end of a pipe given to a stage, served once the stage runs
+struct feed {
+    int fd;
+    const char *body = nullptr;     // heredoc too large to be written up front
+    substitution *sub = nullptr;
+};
+
+static void spawn_pipeline(launch_state &l, pipeline *p, int in, int out);
+
+static void add_process(launch_state &l, pid_t pid, const std::string &text) {
+    process proc{pid};
+    if (l.timed) {
+        clock_gettime(CLOCK_MONOTONIC, &proc.start);
+        proc.text = text;
+    }
+    l.procs.push_back(proc);
+    if (l.leader == 0) {
+        l.leader = pid;
+        if (interactive && l.foreground) {
+            tcsetpgrp(STDIN_FILENO, l.leader);
+            kill(pid, SIGCONT);     // in case it touched the tty before becoming foreground
+        }
+    }
+}
+
+// returns the read end of a pipe holding the body. the pipe is grown to fit
+// (up to /proc/sys/fs/pipe-max-size) so that no process is needed to fill it;
+// a larger body is left to a writer process started after the reader
+static int open_heredoc(const char *body, std::vector<feed> &feeds) {
+    size_t len = strlen(body);
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+    if (len > PIPE_BUF) fcntl(fds[1], F_SETPIPE_SZ, (int)std::min(len, (size_t)INT_MAX));
+    int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+    if (capacity >= 0 && len <= (size_t)capacity) {
+        write_all(fds[1], body, len);
+        close(fds[1]);
+    } else {
+        feeds.push_back(feed{fds[1], body});
+    }
+    return fds[0];
+}
+
+static void start_feed(launch_state &l, const feed &f) {
+    if (f.sub) {
+        // cmd writes into the pipe for <(cmd) and reads from it for >(cmd)
+        spawn_pipeline(l, f.sub->body, f.sub->output ? f.fd : -1, f.sub->output ? -1 : f.fd);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (interactive) setpgid(0, l.leader);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        // keep only the pipe, or the writer would hold other pipes of the job open
+        if (dup2(f.fd, 3) < 0) _exit(1);
+        close_range(4, ~0U, 0);
+        write_all(3, f.body, strlen(f.body));
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+    if (interactive) setpgid(pid, l.leader);
+    add_process(l, pid, "<<");
+}
+
+// start the stages of p, the first one reading from `in` and the last one
+// writing to `out` (-1: the shell's own stdin / stdout)
+static void spawn_pipeline(launch_state &l, pipeline *p, int in, int out) {
+    int cmd_count = p->stage_count;
+    int prev = in;      // read port of the previous stage
+    command *c = p->stages;
+    for (int i = 0; i < cmd_count; ++i, c = c->next) {
+        bool last = i == cmd_count - 1;
+        // every fd the shell opens is close-on-exec: a child gets exactly the fds
+        // its file actions dup2 into place, not the pipes of the other stages
+        int next[2] = {-1, -1};
+        if (!last)
+            assert(pipe2(next, O_CLOEXEC) == 0);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (prev >= 0)
+            posix_spawn_file_actions_adddup2(&actions, prev, 0);
+        int to = last ? out : next[1];
+        if (to >= 0)
+            posix_spawn_file_actions_adddup2(&actions, to, 1);
+
+        std::vector<int> child_ends;    // pipe ends that only the child needs
+        std::vector<feed> feeds;
+        // /dev/fd/N must exist before a redirection like `> >(cmd)` opens it
+        for (substitution *sub = c->substs; sub; sub = sub->next) {
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) < 0) continue;
+            int mine = sub->output ? fds[1] : fds[0];
+            posix_spawn_file_actions_adddup2(&actions, mine, sub->fd);
+            child_ends.push_back(mine);
+            feeds.push_back(feed{sub->output ? fds[0] : fds[1], nullptr, sub});
+        }
+        // redirections of a stage apply to that stage only and come after its pipes,
+        // so `a 2>&1 | b` sends both streams down the pipe and `a | b > f` works in any stage.
+        // file actions run in order, so `2>&1 >f` and `>f 2>&1` differ as in sh
+        for (redirection *r = c->redirs; r; r = r->next) {
+            switch (r->kind) {
+            case redirection::IN:
+            case redirection::OUT:
+            case redirection::APPEND:
+                // Caveat open with O_CREAT must supply permission code
+                posix_spawn_file_actions_addopen(&actions, r->fd, r->target, open_flags(r->kind), 0644);
+                break;
+            case redirection::DUP:
+                posix_spawn_file_actions_adddup2(&actions, r->source, r->fd);
+                break;
+            case redirection::CLOSE:
+                posix_spawn_file_actions_addclose(&actions, r->fd);
+                break;
+            case redirection::HEREDOC: {
+                int fd = open_heredoc(r->target, feeds);
+                if (fd < 0) break;
+                posix_spawn_file_actions_adddup2(&actions, fd, r->fd);
+                child_ends.push_back(fd);
+                break;
+            }
             }
+        }
 
-            return code;
-        } // exit
+        // the pgid is set in the child before exec, so there is no race with tcsetpgrp
+        posix_spawnattr_setpgroup(&l.attr, l.leader);
+        pid_t pid;
+        int err = spawn_command(&pid, c->argv, &actions, &l.attr);
+        posix_spawn_file_actions_destroy(&actions);
+        for (int fd : child_ends) close(fd);
+        if (err < 0) {
+            std::cerr << c->argv[0] << ": command not found\n";
+        } else if (err != 0) {
+            // also reported when opening a redirection file fails
+            std::cerr << "exec " << i << "th subcommand failed: " << strerror(err) << '\n';
+        } else {
+            std::string text;
+            for (int k = 0; l.timed && k < c->argc; ++k)
+                text += (k ? " " : "") + std::string(c->argv[k]);
+            add_process(l, pid, text);
+            // the helpers join the job too, but the stage stays last: it gives the job its status
+            size_t slot = l.procs.size() - 1;
+            for (const feed &f : feeds) start_feed(l, f);
+            std::rotate(l.procs.begin() + slot, l.procs.begin() + slot + 1, l.procs.end());
+        }
+        for (const feed &f : feeds) close(f.fd);
+        if (prev >= 0 && prev != in)
+            close(prev);        // the read port now belongs to this stage
+        if (!last)
+            close(next[1]);     // we dont need the write port anymore
+        prev = next[0];         // pass on read port
+    }
+}
+
+// builtins run inside the shell, so their redirections are applied to the shell's
+// own fds and undone afterwards. the originals are kept as close-on-exec copies
+struct saved_fd {
+    int fd;
+    int copy;   // -1 if fd was not open
+};
 
-        // fork_and_exec(args);
-        execute_with_pipe(args);
+static void restore_fds(std::vector<saved_fd> &saved) {
+    std::cout << std::flush;
+    fflush(stdout);
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+        if (it->copy >= 0) {
+            dup2(it->copy, it->fd);
+            close(it->copy);
+        } else {
+            close(it->fd);
+        }
     }
+    saved.clear();
 }
 
-void execute_with_pipe(std::vector<std::string> &args) {
+static bool redirect_shell(command *c, std::vector<saved_fd> &saved) {
+    for (redirection *r = c->redirs; r; r = r->next) {
+        bool known = false;
+        for (saved_fd &s : saved) known |= s.fd == r->fd;
+        if (!known) saved.push_back(saved_fd{r->fd, fcntl(r->fd, F_DUPFD_CLOEXEC, 10)});
+
+        int fd = -1;
+        switch (r->kind) {
+        case redirection::IN:
+        case redirection::OUT:
+        case redirection::APPEND:
+            fd = open(r->target, open_flags(r->kind) | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                std::cerr << r->target << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            break;
+        case redirection::DUP:
+            fd = r->source;
+            break;
+        case redirection::CLOSE:
+            close(r->fd);
+            continue;
+        case redirection::HEREDOC: {
+            // no builtin reads its stdin, a body larger than the pipe is cut short
+            std::vector<feed> feeds;
+            fd = open_heredoc(r->target, feeds);
+            for (const feed &f : feeds) close(f.fd);
+            break;
+        }
+        }
+        if (fd != r->fd && dup2(fd, r->fd) < 0) {
+            std::cerr << r->fd << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (fd != r->source && fd != r->fd) close(fd);
+    }
+    return true;
+}
+
+void run_in_shell(pipeline *p) {
+    command *c = p->stages;
+    std::vector<saved_fd> saved;
+    std::cout << std::flush;
+    fflush(stdout);
+    if (!redirect_shell(c, saved)) {
+        restore_fds(saved);
+        last_status = 1;
+        return;
+    }
+    got_sigint = 0;
+    if (!p->timed) {
+        in_builtin = 1;
+        run_builtin(c);
+        in_builtin = 0;
+        restore_fds(saved);
+        return;
+    }
+
+    // `time` charges a builtin with what the shell used meanwhile
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    job j;
+    clock_gettime(CLOCK_MONOTONIC, &j.start);
+    in_builtin = 1;
+    run_builtin(c);
+    in_builtin = 0;
+    process self{getpid()};
+    clock_gettime(CLOCK_MONOTONIC, &self.end);
+    getrusage(RUSAGE_SELF, &self.usage);
+    timersub(&self.usage.ru_utime, &before.ru_utime, &self.usage.ru_utime);
+    timersub(&self.usage.ru_stime, &before.ru_stime, &self.usage.ru_stime);
+    self.usage.ru_nvcsw -= before.ru_nvcsw;
+    self.usage.ru_nivcsw -= before.ru_nivcsw;
+    self.start = j.start;
+    self.text = c->argv[0];
+    j.procs.push_back(self);
+    restore_fds(saved);
+    print_times(j);
+}
+
+void execute_with_pipe(pipeline *p) {
     // struct termios settings;
     // if (tcgetattr(STDIN_FILENO, &settings) < 0) {
     //     perror("error in tcgetattr");
     //     exit(255);
     // }
 
-    std::vector<int> cmd_idx;
-    cmd_idx.push_back(0);
-    char *arg_ptrs[args.size() + 1];
-    bool first = true, last = false;
-    std::map<int, std::string> redir_from, redir_to;
-    std::map<int, bool> append;
-    for (int i = 0; i < args.size(); i++) {
-        arg_ptrs[i] = nullptr;
-        int len = args[i].length();
-        if (!len) continue;
-        if (args[i] == "|") {
-            first = last = false;
-            append.clear();
-            redir_to.clear();
-            cmd_idx.push_back(i + 1);
-        } else if (args[i][len - 1] == '<' || args[i][len - 1] == '>') {
-            bool error = false;
-            int fildes;
-            char *endpos = nullptr;
-            fildes = strtol(args[i].c_str(), &endpos, 10);
-            if (endpos == &args[i][0] + len - 1) {
-                if (*endpos == '<') {
-                    // read from file
-                    // only effective for the first command in the chain
-                    if (!first) { continue; }
-                    if (endpos == &args[i][0]) fildes = 0;
-                    redir_from[fildes] = args[i+1]; ++i;
-                    // TODO range check
-                } else if (*endpos == '>') {
-                    // write to file
-                    // only effective for the last command in the chain
-                    if (endpos == &args[i][0]) fildes = 1;
-                    last = true; append[fildes] = 0;
-                    redir_to[fildes] = args[i+1]; ++i;
-                    // TODO range check
-                } else {
-                    error = true;
-                }
-            } else if (endpos == &args[i][0] + len - 2) {
-                if (*endpos == '>' && *(endpos + 1) == '>') {
-                    // append to file
-                    // only effective for the last command in the chain
-                    if (endpos == &args[i][0]) fildes = 1;
-                    last = true; append[fildes] = 1;
-                    redir_to[fildes] = args[i+1]; ++i;
-                    // TODO range check
+    // builtins write through stdio, which must reach the fd before the children do
+    std::cout << std::flush;
+    fflush(stdout);
+
+// #define DEBUG
+#ifdef DEBUG
+    int k = 0;
+    for (command *c = p->stages; c; c = c->next, ++k) {
+        std::cout << "cmd #" << k << ": [" << c->argv[0];
+        for (int j = 1; j < c->argc; ++j) {
+            std::cout << ", " << c->argv[j];
+        }
+        std::cout << "]" << std::endl;
+        for (redirection *r = c->redirs; r; r = r->next)
+            std::cout << "#" << r->fd << (r->kind == redirection::IN ? " input file: " : " output file: ")
+                      << r->target << std::endl;
+    }
+#endif
+
+    launch_state l;
+    init_spawnattr(&l.attr);
+    l.foreground = !p->background;
+    l.timed = p->timed;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    spawn_pipeline(l, p, -1, -1);
+    posix_spawnattr_destroy(&l.attr);
+
+    if (l.procs.empty()) {
+        last_status = 127;
+        return;
+    }
+    int id = jobs.empty() ? 1 : 0;
+    for (auto &entry : jobs) id = std::max(id, entry.second.id + 1);
+    job &j = jobs[l.leader];
+    j.id = id;
+    j.pgid = l.leader;
+    j.text = p->text;
+    j.procs = std::move(l.procs);
+    j.timed = p->timed;
+    j.start = start;
+
+    if (p->background) {
+        if (interactive) std::cerr << "[" << j.id << "] " << j.procs.back().pid << std::endl;
+        last_status = 0;
+    } else {
+        put_job_in_foreground(j, false);
+    }
+}
+
+bool job::completed() const {
+    for (const process &proc : procs)
+        if (!proc.completed) return false;
+    return true;
+}
+
+bool job::stopped() const {
+    bool any = false;
+    for (const process &proc : procs) {
+        if (!proc.completed && !proc.stopped) return false;
+        any |= proc.stopped;
+    }
+    return any;
+}
+
+void update_process(pid_t pid, int status, const struct rusage &usage) {
+    for (auto &entry : jobs) {
+        for (process &proc : entry.second.procs) {
+            if (proc.pid != pid) continue;
+            if (WIFSTOPPED(status)) {
+                proc.stopped = true;
+            } else if (WIFCONTINUED(status)) {
+                proc.stopped = false;
+            } else {
+                proc.completed = true;
+                proc.status = status;
+                proc.usage = usage;
+                clock_gettime(CLOCK_MONOTONIC, &proc.end);
+            }
+            return;
+        }
+    }
+}
+
+// wait4 rather than waitpid: the rusage of each stage is what `time` reports
+void reap_children() {
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+        update_process(pid, status, usage);
+}
+
+void wait_for_job(job &j) {
+    while (!j.completed() && !j.stopped()) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR && !got_sigint) continue;
+            break;
+        }
+        update_process(pid, status, usage);
+    }
+}
+
+int exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 0;
+}
+
+static std::string describe(const job &j) {
+    if (!j.completed()) return j.stopped() ? "Stopped" : "Running";
+    int status = j.procs.back().status;
+    if (WIFSIGNALED(status)) return strsignal(WTERMSIG(status));
+    if (WEXITSTATUS(status)) return "Exit " + std::to_string(WEXITSTATUS(status));
+    return "Done";
+}
+
+void print_job(const job &j) {
+    int newest = 0;
+    for (auto &entry : jobs) newest = std::max(newest, entry.second.id);
+    std::string state = describe(j);
+    state.resize(std::max(state.size(), (size_t)24), ' ');
+    std::cerr << "[" << j.id << "]" << (j.id == newest ? '+' : ' ') << "  " << state << j.text
+              << (j.completed() || j.stopped() ? "" : " &") << std::endl;
+}
+
+// the pipeline status is the one of its last stage
+void put_job_in_foreground(job &j, bool cont) {
+    if (interactive) tcsetpgrp(STDIN_FILENO, j.pgid);
+    if (cont) {
+        if (j.has_tmodes) tcsetattr(STDIN_FILENO, TCSADRAIN, &j.tmodes);
+        for (process &proc : j.procs) proc.stopped = false;
+        j.notified = false;
+        kill(-j.pgid, SIGCONT);
+    }
+    wait_for_job(j);
+    if (interactive) {
+        if (j.stopped()) {
+            tcgetattr(STDIN_FILENO, &j.tmodes);
+            j.has_tmodes = true;
+        }
+        if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0) {
+            // 不过好像这里设置前台失败的话，怎么输出错误信息都是没法看到的吧……
+            std::cerr << "set oneself as foreground process group failed: " << strerror(errno) << std::endl;
+            exit(255);
+        }
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    if (j.stopped()) {
+        std::cerr << std::endl;
+        print_job(j);
+        j.notified = true;
+        last_status = 128 + SIGTSTP;
+    } else {
+        last_status = exit_code(j.procs.back().status);
+        if (j.timed) print_times(j);
+        jobs.erase(j.pgid);
+    }
+}
+
+// report jobs that finished or stopped since the last prompt
+// a script drops its finished jobs silently
+void notify_jobs() {
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        job &j = it->second;
+        if (j.completed()) {
+            if (interactive) {
+                print_job(j);
+                if (j.timed) print_times(j);
+            }
+            it = jobs.erase(it);
+            continue;
+        }
+        if (interactive && j.stopped() && !j.notified) {
+            print_job(j);
+            j.notified = true;
+        }
+        ++it;
+    }
+}
+
+// %n, %%, %+ or a bare n; nullptr means the current (newest) job
+job *find_job(const char *spec) {
+    job *found = nullptr;
+    int id = -1;
+    if (spec && strcmp(spec, "%%") && strcmp(spec, "%+") && strcmp(spec, "%")) {
+        id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    }
+    for (auto &entry : jobs) {
+        if (id < 0 ? (found == nullptr || entry.second.id > found->id) : entry.second.id == id)
+            found = &entry.second;
+    }
+    return found;
+}
+
+static double seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double seconds_between(const struct timespec &a, const struct timespec &b) {
+    return (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+}
+
+// the report of `time`: one row per stage, so the slow stage of `a | b | c` stands out.
+// wall is from the start of the pipeline to the reaping of its last stage.
+// maxrss never goes below the shell's own RSS: posix_spawn runs the child in the
+// shell's address space until execve, and the kernel counts that as the child's peak
+void print_times(const job &j) {
+    double wall = 0, user = 0, sys = 0;
+    fprintf(stderr, "%5s %9s %9s %9s %10s %7s %7s  %s\n",
+            "stage", "wall", "user", "sys", "maxrss", "nvcsw", "nivcsw", "command");
+    int k = 0;
+    for (const process &proc : j.procs) {
+        const struct rusage &ru = proc.usage;
+        fprintf(stderr, "%5d %8.3fs %8.3fs %8.3fs %8ldKB %7ld %7ld  %s\n", ++k,
+                seconds_between(proc.start, proc.end), seconds(ru.ru_utime), seconds(ru.ru_stime),
+                ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw, proc.text.c_str());
+        wall = std::max(wall, seconds_between(j.start, proc.end));
+        user += seconds(ru.ru_utime);
+        sys += seconds(ru.ru_stime);
+    }
+    fprintf(stderr, "%5s %8.3fs %8.3fs %8.3fs\n", "total", wall, user, sys);
+}
+
+// parallel [-j N] cmd [args...] ::: arg...
+// runs cmd once per argument after `:::`, with `{}` replaced by the argument
+// (or the argument appended), at most N at a time (default: online CPUs).
+// the output of each job is captured through a pipe: the oldest unfinished job
+// streams straight to stdout, later ones are buffered until it is their turn,
+// so the output comes out in argument order no matter which job finishes first
+struct parallel_task {
+    std::vector<std::string> args;
+    pid_t pid = -1;
+    int pidfd = -1;         // readable once the child exits
+    int out = -1;           // read end of its stdout pipe
+    std::string pending;    // output held back until the job reaches the head
+    bool exited = false;
+    int status = 0;
+    struct rusage usage = {};
+    struct timespec start = {}, end = {};
+    bool done() const { return exited && out < 0; }
+};
+
+static bool launch_task(parallel_task &t, pid_t &pgid) {
+    std::vector<char *> argv;
+    for (std::string &arg : t.args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return false;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+
+    // the whole pool is one process group in the foreground, so Ctrl-C reaches every job;
+    // SIGTSTP stays ignored since the pool cannot be resumed as a job
+    posix_spawnattr_t attr;
+    init_spawnattr(&attr);
+    sigset_t sigdefault;
+    posix_spawnattr_getsigdefault(&attr, &sigdefault);
+    sigdelset(&sigdefault, SIGTSTP);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setpgroup(&attr, pgid);
+
+    clock_gettime(CLOCK_MONOTONIC, &t.start);
+    int err = spawn_command(&t.pid, argv.data(), &actions, &attr);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        if (err < 0) std::cerr << "parallel: " << argv[0] << ": command not found\n";
+        else std::cerr << "parallel: " << argv[0] << ": " << strerror(err) << '\n';
+        t.exited = true;
+        t.status = W_EXITCODE(127, 0);
+        t.end = t.start;
+        return false;
+    }
+    t.out = fds[0];
+    if (interactive && pgid == 0) {
+        pgid = t.pid;
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+    t.pidfd = syscall(SYS_pidfd_open, t.pid, 0);  // -1 before Linux 5.3: fall back to polling
+    return true;
+}
+
+void run_parallel(int argc, char **argv) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (i < argc && !strncmp(argv[i], "-j", 2)) {
+        const char *n = argv[i][2] ? argv[i] + 2 : (++i < argc ? argv[i] : "");
+        limit = atol(n);
+        ++i;
+    }
+    int sep = i;
+    while (sep < argc && strcmp(argv[sep], ":::")) ++sep;
+    if (limit <= 0 || sep == i || sep == argc) {
+        std::cerr << "usage: parallel [-j N] command [args...] ::: arg..." << std::endl;
+        last_status = 2;
+        return;
+    }
+
+    std::vector<parallel_task> tasks(argc - sep - 1);
+    for (size_t k = 0; k < tasks.size(); ++k) {
+        std::string_view value = argv[sep + 1 + k];
+        bool substituted = false;
+        for (int w = i; w < sep; ++w) {
+            std::string word = argv[w];
+            for (size_t pos = 0; (pos = word.find("{}", pos)) != std::string::npos; pos += value.size()) {
+                word.replace(pos, 2, value);
+                substituted = true;
+            }
+            tasks[k].args.push_back(std::move(word));
+        }
+        if (!substituted) tasks[k].args.emplace_back(value);
+    }
+
+    std::cout << std::flush;
+    fflush(stdout);
+
+    pid_t pgid = 0;
+    size_t next = 0, head = 0;
+    long running = 0;
+    bool interrupted = false;
+    char buf[65536];
+    while (head < tasks.size()) {
+        while (!interrupted && running < limit && next < tasks.size()) {
+            if (running == 0) pgid = 0;     // the old group may be gone, start a new one
+            if (launch_task(tasks[next++], pgid)) ++running;
+        }
+
+        // one slot per fd, so that the revents can be mapped back to the tasks
+        std::vector<struct pollfd> fds;
+        std::vector<size_t> owner;
+        bool blind = false;     // a child without pidfd has to be polled for
+        for (size_t k = head; k < next; ++k) {
+            parallel_task &t = tasks[k];
+            if (t.out >= 0) {
+                fds.push_back({t.out, POLLIN, 0});
+                owner.push_back(k);
+            }
+            if (!t.exited) {
+                if (t.pidfd >= 0) {
+                    fds.push_back({t.pidfd, POLLIN, 0});
+                    owner.push_back(k);
                 } else {
-                    error = true;
+                    blind = true;
                 }
-            } else {
-                error = true;
             }
-            if (error) {
-                std::cerr << "parsing redirection failed" << std::endl;
+        }
+        if ((!fds.empty() || blind) && poll(fds.data(), fds.size(), blind ? 10 : -1) < 0 && errno != EINTR)
+            break;
+
+        for (size_t f = 0; f < fds.size(); ++f) {
+            parallel_task &t = tasks[owner[f]];
+            if (!fds[f].revents || fds[f].fd != t.out) continue;
+            ssize_t n = read(t.out, buf, sizeof(buf));
+            if (n > 0) {
+                if (owner[f] == head) write_all(STDOUT_FILENO, buf, n);
+                else t.pending.append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(t.out);
+                t.out = -1;
+            }
+        }
+        // wait4 instead of waitid: it also returns the rusage of the child
+        for (size_t k = head; k < next; ++k) {
+            parallel_task &t = tasks[k];
+            if (t.exited || wait4(t.pid, &t.status, WNOHANG, &t.usage) <= 0) continue;
+            clock_gettime(CLOCK_MONOTONIC, &t.end);
+            t.exited = true;
+            --running;
+            if (t.pidfd >= 0) close(t.pidfd);
+            t.pidfd = -1;
+            if (WIFSIGNALED(t.status) && WTERMSIG(t.status) == SIGINT) interrupted = true;
+        }
+
+        while (head < next && tasks[head].done()) {
+            if (++head < next) {
+                std::string &pending = tasks[head].pending;
+                write_all(STDOUT_FILENO, pending.data(), pending.size());
+                std::string().swap(pending);
             }
+        }
+        if (interrupted && head == next) break;
+    }
+
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    // like GNU parallel: the number of failed jobs, 101 meaning more than 100
+    int failed = 0;
+    fprintf(stderr, "%5s %7s %9s %9s %9s  %s\n", "job", "status", "wall", "user", "sys", "command");
+    for (size_t k = 0; k < next; ++k) {
+        parallel_task &t = tasks[k];
+        int code = exit_code(t.status);
+        failed += code != 0;
+        std::string cmdline;
+        for (std::string &arg : t.args) cmdline += (cmdline.empty() ? "" : " ") + arg;
+        fprintf(stderr, "%5zu %7d %8.3fs %8.3fs %8.3fs  %s\n", k + 1, code,
+                seconds_between(t.start, t.end), seconds(t.usage.ru_utime),
+                seconds(t.usage.ru_stime), cmdline.c_str());
+    }
+    if (next < tasks.size())
+        fprintf(stderr, "parallel: interrupted, %zu jobs not started\n", tasks.size() - next);
+    last_status = interrupted ? 128 + SIGINT : std::min(failed, 101);
+}
+
+// the children are started with posix_spawn, which glibc implements with
+// clone(CLONE_VM|CLONE_VFORK): no page tables of the shell (history, readline state)
+// are copied, and all the child-side setup is described by file actions
+void init_spawnattr(posix_spawnattr_t *attr) {
+    posix_spawnattr_init(attr);
+    sigset_t sigdefault, sigmask;
+    sigemptyset(&sigmask);
+    sigemptyset(&sigdefault);
+    for (int sig : {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE})
+        sigaddset(&sigdefault, sig);
+    posix_spawnattr_setsigdefault(attr, &sigdefault);
+    posix_spawnattr_setsigmask(attr, &sigmask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (interactive) flags |= POSIX_SPAWN_SETPGROUP;  // no job control in scripts
+    posix_spawnattr_setflags(attr, flags);
+}
+
+// start argv[0] found through the command hash
+// returns 0, an errno value from posix_spawn, or -1 if the command does not exist
+int spawn_command(pid_t *pid, char *const argv[],
+                  const posix_spawn_file_actions_t *actions, const posix_spawnattr_t *attr) {
+    std::string path;
+    int err = -1;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (!resolve_command(argv[0], path)) break;
+        err = posix_spawn(pid, path.c_str(), actions, attr, argv, environ);
+        // ENOENT also comes from a failed open file action (`cmd < missing`),
+        // which a second lookup would not fix and would run the command twice
+        if (err != ENOENT || access(path.c_str(), X_OK) == 0) break;
+        // the cached binary was removed or moved, look it up again
+        command_hash.erase(argv[0]);
+    }
+    if (err == ENOEXEC) {
+        // a script without #!: posix_spawn does not fall back to the shell
+        // the way execvp does, so hand it to /bin/sh ourselves
+        std::vector<char *> sh_argv = {const_cast<char *>("sh"), path.data()};
+        for (int k = 1; argv[k]; ++k) sh_argv.push_back(argv[k]);
+        sh_argv.push_back(nullptr);
+        err = posix_spawn(pid, "/bin/sh", actions, attr, sh_argv.data(), environ);
+    }
+    return path.empty() ? -1 : err;
+}
+
+bool resolve_command(const char *name, std::string &path) {
+    path.clear();
+    if (strchr(name, '/')) {
+        path = name;
+        return true;
+    }
+    auto it = command_hash.find(name);
+    if (it != command_hash.end()) {
+        ++it->second.hits;
+        path = it->second.path;
+        return true;
+    }
+
+    const char *env = getenv("PATH");
+    std::string_view dirs = env ? env : "/usr/local/bin:/usr/bin:/bin";
+    std::string candidate;
+    while (true) {
+        size_t colon = dirs.find(':');
+        std::string_view dir = dirs.substr(0, colon);
+        candidate.assign(dir.empty() ? "." : dir);
+        candidate.push_back('/');
+        candidate.append(name);
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate.c_str(), X_OK) == 0) {
+            hashed_command &entry = command_hash[name];
+            entry.path = candidate;
+            entry.hits = 1;
+            path = candidate;
+            return true;
+        }
+        if (colon == std::string_view::npos) break;
+        dirs.remove_prefix(colon + 1);
+    }
+    return false;
+}
+
+void *arena::alloc(size_t n, size_t align) {
+    size_t pad = (align - (uintptr_t)cur % align) % align;
+    if (cur == nullptr || pad + n > left) {
+        // oversized requests (a multi-MB word) get a block of their own
+        size_t size = std::max(n + align, (size_t)BLOCK_SIZE);
+        cur = new char[size];
+        blocks.push_back(cur);
+        left = size;
+        pad = (align - (uintptr_t)cur % align) % align;
+    }
+    void *ret = cur + pad;
+    cur += pad + n;
+    left -= pad + n;
+    return ret;
+}
+
+char *arena::copy(std::string_view s) {
+    char *ret = (char *)alloc(s.size() + 1, 1);
+    memcpy(ret, s.data(), s.size());
+    ret[s.size()] = '\0';
+    return ret;
+}
+
+void arena::reset() {
+    for (char *b : blocks) delete[] b;
+    blocks.clear();
+    cur = nullptr;
+    left = 0;
+}
+
+static bool is_operator_char(char c) {
+    return c == '|' || c == ';' || c == '&' || c == '<' || c == '>';
+}
+
+// find where the word starting at pos ends, honoring quotes and backslashes
+size_t lexer::word_end(bool &ok) const {
+    size_t i = pos;
+    char quote = '\0';
+    ok = true;
+    for (; i < in.size(); ++i) {
+        char ch = in[i];
+        if (quote == '\'') {
+            if (ch == '\'') quote = '\0';
+        } else if (ch == '\\') {
+            if (++i == in.size()) break;  // trailing backslash is kept literally
+        } else if (quote == '"') {
+            if (ch == '"') quote = '\0';
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+        } else if (isspace(ch) || is_operator_char(ch)) {
+            break;
+        }
+    }
+    if (quote) ok = false;
+    return i;
+}
+
+// copy in[pos, end) into the arena with quotes and escapes removed, and tell
+// whether an unquoted glob character was seen. as_pattern keeps the glob
+// characters that were quoted as such by escaping them with a backslash
+char *lexer::unquote(size_t end, bool as_pattern, bool &glob) {
+    char *out = (char *)mem.alloc((as_pattern ? 2 : 1) * (end - pos) + 1, 1);
+    char *w = out;
+    char quote = '\0';
+    glob = false;
+    auto literal = [&](char ch) {
+        if (as_pattern && strchr("*?[]\\", ch)) *w++ = '\\';
+        *w++ = ch;
+    };
+    for (size_t i = pos; i < end; ++i) {
+        char ch = in[i];
+        if (quote == '\'') {
+            if (ch == '\'') quote = '\0';
+            else literal(ch);
+        } else if (ch == '\\') {
+            if (i + 1 == end) {
+                literal(ch);
+            } else if (quote == '"' && !strchr("\"\\$`", in[i + 1])) {
+                // inside double quotes only a few characters are escapable
+                literal(ch);
+            } else {
+                literal(in[++i]);
+            }
+        } else if (quote == '"') {
+            if (ch == '"') quote = '\0';
+            else literal(ch);
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
         } else {
-            arg_ptrs[i] = &args[i][0];
+            if (ch == '*' || ch == '?' || ch == '[') glob = true;
+            *w++ = ch;
         }
     }
-    arg_ptrs[args.size()] = nullptr;
-    int cmd_count = cmd_idx.size();
-    if (!last) redir_to.clear();
+    *w = '\0';
+    pos = end;
+    return out;
+}
 
-// #define DEBUG
-#ifdef DEBUG
-    if (redir_from.size()) {
-        for (auto p : redir_from)
-            std::cout << "#" << p.first << " input file: " << p.second << std::endl;
+token lexer::next() {
+    token t;
+    while (pos < in.size() && isspace(in[pos])) ++pos;
+    if (pos < in.size() && in[pos] == '#') {
+        // a comment runs to the end of line
+        pos = in.size();
+    }
+    if (pos == in.size()) {
+        t.kind = token::END;
+        return t;
     }
-    for (int i = 0; i < cmd_count; ++i) {
-        std::cout << "cmd #" << i << ": [" << args[cmd_idx[i]];
-        for (int j = cmd_idx[i] + 1; arg_ptrs[j]; ++j) {
-            std::cout << ", " << arg_ptrs[j];
+
+    // an unquoted run of digits directly followed by < or > is a file descriptor
+    size_t digits = pos;
+    while (digits < in.size() && isdigit(in[digits])) ++digits;
+    if (digits != pos && digits < in.size() && (in[digits] == '<' || in[digits] == '>')) {
+        t.io_number = 0;
+        for (; pos < digits; ++pos) {
+            t.io_number = t.io_number * 10 + (in[pos] - '0');
+            if (t.io_number > 1024) {
+                error = "file descriptor out of range";
+                t.kind = token::ERROR;
+                return t;
+            }
         }
-        std::cout << "]" << std::endl;
     }
-    if (redir_to.size()) {
-        for (auto p : redir_to)
-            std::cout << "#" << p.first << " output file: " << p.second << std::endl;
+
+    auto follows = [&](std::string_view s) { return in.substr(pos, s.size()) == s; };
+    switch (in[pos]) {
+    case '|': ++pos; t.kind = token::PIPE; return t;
+    case ';': ++pos; t.kind = token::SEMI; return t;
+    case '&': ++pos; t.kind = token::AMP; return t;
+    case '<':
+        if (t.io_number < 0 && follows("<(")) return subcommand(token::PROCSUB_IN);
+        if (follows("<<<")) t.kind = token::TLESS;
+        else if (follows("<<-")) t.kind = token::DLESSDASH;
+        else if (follows("<<")) t.kind = token::DLESS;
+        else if (follows("<&")) t.kind = token::LESSAND;
+        else t.kind = token::LESS;
+        pos += t.kind == token::LESS ? 1 : t.kind == token::TLESS || t.kind == token::DLESSDASH ? 3 : 2;
+        return t;
+    case '>':
+        if (t.io_number < 0 && follows(">(")) return subcommand(token::PROCSUB_OUT);
+        if (follows(">>")) t.kind = token::DGREAT;
+        else if (follows(">&")) t.kind = token::GREATAND;
+        else t.kind = token::GREAT;
+        pos += t.kind == token::GREAT ? 1 : 2;
+        return t;
     }
-#endif
 
-    int fds[2] = {0, 1}, fds_next[2] = {0, 1};
-
-    bool first_process = true;
-    pid_t leader_pid = 0;
-    for (int i = 0; i < cmd_count; ++i) {
-        if (i != cmd_count - 1)
-            assert(pipe(fds_next) == 0);
-        pid_t pid = fork();
-        if (pid == 0) {
-            if (first_process) leader_pid = getpid();
-            setpgid(0, leader_pid);
-            if (i != 0) {
-                close(0); assert(dup(fds[0]) == 0); close(fds[0]);
-            } else if (redir_from.size()) {
-                // input redir
-                for (std::pair<int, std::string> rfile : redir_from) {
-                    fds[0] = open(rfile.second.c_str(), O_RDONLY);
-                    if (fds[0] < 0) {
-                        std::cerr << "open redirection input file failed: " << strerror(errno) << std::endl;
-                        exit(255);
-                    }
-                    close(rfile.first); assert(dup(fds[0]) == rfile.first); close(fds[0]);
+    bool ok;
+    size_t end = word_end(ok);
+    if (!ok) {
+        error = "unterminated quote";
+        t.kind = token::ERROR;
+        return t;
+    }
+    t.kind = token::WORD;
+    size_t begin = pos;
+    bool glob;
+    t.word = unquote(end, false, glob);
+    if (glob) {
+        pos = begin;
+        t.pattern = unquote(end, true, glob);
+    }
+    return t;
+}
+
+// <(...) or >(...): the text up to the matching parenthesis, parsed later on its own
+token lexer::subcommand(token::kind_t kind) {
+    token t;
+    size_t begin = pos + 2, i = begin;
+    int depth = 1;
+    char quote = '\0';
+    for (; i < in.size(); ++i) {
+        char ch = in[i];
+        if (quote == '\'') {
+            if (ch == '\'') quote = '\0';
+        } else if (ch == '\\') {
+            ++i;
+        } else if (quote == '"') {
+            if (ch == '"') quote = '\0';
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+        } else if (ch == '(') {
+            ++depth;
+        } else if (ch == ')' && --depth == 0) {
+            break;
+        }
+    }
+    if (i >= in.size()) {
+        error = "unterminated process substitution";
+        t.kind = token::ERROR;
+        return t;
+    }
+    t.kind = kind;
+    t.word = mem.copy(in.substr(begin, i - begin));
+    pos = i + 1;
+    return t;
+}
+
+static const char *token_name(const token &t) {
+    switch (t.kind) {
+    case token::PIPE: return "|";
+    case token::SEMI: return ";";
+    case token::AMP: return "&";
+    case token::LESS: return "<";
+    case token::GREAT: return ">";
+    case token::DGREAT: return ">>";
+    case token::LESSAND: return "<&";
+    case token::GREATAND: return ">&";
+    case token::DLESS: return "<<";
+    case token::DLESSDASH: return "<<-";
+    case token::TLESS: return "<<<";
+    case token::PROCSUB_IN: return "<(";
+    case token::PROCSUB_OUT: return ">(";
+    default: return "newline";
+    }
+}
+
+// line     := pipeline ((';' | '&') pipeline)* [';' | '&']
+// pipeline := command ('|' command)*
+// command  := (word | '<(' line ')' | '>(' line ')' | [n] redir-op word)+
+// redir-op := '<' | '>' | '>>' | '<&' | '>&' | '<<' | '<<-' | '<<<'
+// heredoc bodies are taken from `more` once the whole line has been parsed
+bool parse(std::string_view line, arena &mem, pipeline *&out, line_source *more) {
+    lexer lex(line, mem);
+    std::vector<char *> words;      // argv of the stage being built, reused
+    std::vector<char *> patterns;   // and the glob pattern of each word
+    pipeline head, *tail = &head;
+    pipeline *p = nullptr;
+    command *cmd = nullptr, *last_stage = nullptr;
+    redirection *last_redir = nullptr;
+    size_t text_begin = 0;
+    int subst_fd = 0;               // next /dev/fd number for the current stage
+    std::vector<std::pair<redirection *, bool>> heredocs;  // waiting for a body, strip tabs
+
+    out = nullptr;
+    auto finish_stage = [&]() {
+        cmd->argc = words.size();
+        cmd->argv = (char **)mem.alloc((words.size() + 1) * sizeof(char *), alignof(char *));
+        std::copy(words.begin(), words.end(), cmd->argv);
+        cmd->argv[words.size()] = nullptr;
+        if (std::any_of(patterns.begin(), patterns.end(), [](char *p) { return p != nullptr; })) {
+            cmd->patterns = (char **)mem.alloc(patterns.size() * sizeof(char *), alignof(char *));
+            std::copy(patterns.begin(), patterns.end(), cmd->patterns);
+        }
+        words.clear();
+        patterns.clear();
+    };
+    auto syntax_error = [&](const token &t) {
+        if (t.kind == token::ERROR)
+            std::cerr << "syntax error: " << lex.error << std::endl;
+        else
+            std::cerr << "syntax error near unexpected token `" << token_name(t) << "'" << std::endl;
+        return false;
+    };
+    // attach a process substitution to the current stage, its word becomes /dev/fd/N
+    auto substitute = [&](token &t) {
+        pipeline *body;
+        if (!parse(t.word, mem, body)) return false;
+        if (body == nullptr || body->next || body->background || body->stage_count == 0) {
+            std::cerr << "syntax error: bad process substitution `" << t.word << "'" << std::endl;
+            return false;
+        }
+        if (subst_fd < 10) {
+            std::cerr << "too many process substitutions" << std::endl;
+            return false;
+        }
+        substitution *sub = mem.make<substitution>();
+        sub->body = body;
+        sub->output = t.kind == token::PROCSUB_OUT;
+        sub->fd = subst_fd--;
+        sub->next = cmd->substs;
+        cmd->substs = sub;
+        t.word = mem.copy("/dev/fd/" + std::to_string(sub->fd));
+        return true;
+    };
+
+    while (true) {
+        size_t token_begin = lex.offset();
+        token t = lex.next();
+        if (t.kind == token::ERROR) return syntax_error(t);
+
+        if (t.kind != token::PIPE && t.kind != token::SEMI &&
+            t.kind != token::AMP && t.kind != token::END) {
+            if (p == nullptr) {
+                p = mem.make<pipeline>();
+                tail->next = p;
+                tail = p;
+                last_stage = nullptr;
+                text_begin = token_begin;
+                // `time` is a keyword only in front of a pipeline, and only unquoted
+                if (t.kind == token::WORD &&
+                    sanitize(line.substr(token_begin, lex.offset() - token_begin)) == "time") {
+                    p->timed = true;
+                    text_begin = lex.offset();
+                    continue;
                 }
             }
-            if (i != cmd_count - 1) {
-                close(fds_next[0]);
-                close(1); assert(dup(fds_next[1]) == 1); close(fds_next[1]);
-            } else if (redir_to.size()) {
-                // output redir
-                int oflag = O_WRONLY | O_CREAT;
-                int aflag = O_WRONLY | O_CREAT | O_APPEND;
-                // Caveat open with O_CREAT must supply permission code
-                for (std::pair<int, std::string> wfile : redir_to) {
-                    fds_next[1] =
-                        open(wfile.second.c_str(),
-                             append[wfile.first] ? aflag : oflag,
-                             0644);
-                    if (fds_next[1] < 0) {
-                        std::cerr << "open redirection output file failed: " << strerror(errno) << std::endl;
-                        exit(255);
-                    }
-                    close(wfile.first); assert(dup(fds_next[1]) == wfile.first); close(fds_next[1]);
+            if (cmd == nullptr) {
+                cmd = mem.make<command>();
+                if (last_stage) last_stage->next = cmd;
+                else p->stages = cmd;
+                last_stage = cmd;
+                last_redir = nullptr;
+                subst_fd = 63;
+                ++p->stage_count;
+            }
+            if (t.kind == token::WORD) {
+                words.push_back(t.word);
+                patterns.push_back(t.pattern);
+                p->text = sanitize(line.substr(text_begin, lex.offset() - text_begin));
+                continue;
+            }
+            if (t.kind == token::PROCSUB_IN || t.kind == token::PROCSUB_OUT) {
+                if (!substitute(t)) return false;
+                words.push_back(t.word);
+                patterns.push_back(nullptr);
+                p->text = sanitize(line.substr(text_begin, lex.offset() - text_begin));
+                continue;
+            }
+            token target = lex.next();
+            if (target.kind == token::PROCSUB_IN || target.kind == token::PROCSUB_OUT) {
+                // `> >(cmd)`
+                if (!substitute(target)) return false;
+                target.kind = token::WORD;
+            }
+            if (target.kind != token::WORD) return syntax_error(target);
+            p->text = sanitize(line.substr(text_begin, lex.offset() - text_begin));
+            redirection *r = mem.make<redirection>();
+            bool input = t.kind == token::LESS || t.kind == token::LESSAND || t.kind == token::DLESS ||
+                         t.kind == token::DLESSDASH || t.kind == token::TLESS;
+            r->fd = t.io_number >= 0 ? t.io_number : (input ? 0 : 1);
+            r->target = target.word;
+            switch (t.kind) {
+            case token::LESS: r->kind = redirection::IN; break;
+            case token::GREAT: r->kind = redirection::OUT; break;
+            case token::DGREAT: r->kind = redirection::APPEND; break;
+            case token::LESSAND:
+            case token::GREATAND: {
+                // only `n>&m` and `n>&-`, not bash's `>&file`
+                std::string_view fd = target.word;
+                if (fd == "-") {
+                    r->kind = redirection::CLOSE;
+                    break;
+                }
+                if (fd.empty() || fd.size() > 4 || fd.find_first_not_of("0123456789") != std::string_view::npos) {
+                    std::cerr << target.word << ": bad file descriptor" << std::endl;
+                    return false;
                 }
+                r->kind = redirection::DUP;
+                r->source = atoi(target.word);
+                break;
             }
-            execvp(args[cmd_idx[i]].c_str(), arg_ptrs + cmd_idx[i]);
-            std::cerr << "exec " << i << "th subcommand failed: " << strerror(errno) << '\n';
-            exit(255);
+            case token::TLESS: {
+                std::string body = std::string(target.word) + "\n";
+                r->kind = redirection::HEREDOC;
+                r->target = mem.copy(body);
+                break;
+            }
+            default:
+                r->kind = redirection::HEREDOC;
+                heredocs.emplace_back(r, t.kind == token::DLESSDASH);
+            }
+            if (last_redir) last_redir->next = r;
+            else cmd->redirs = r;
+            last_redir = r;
+            continue;
         }
-        if (first_process) {
-            leader_pid = pid;
+
+        // an operator or the end of line closes the current stage
+        if (cmd != nullptr) {
+            if (words.empty()) return syntax_error(t);  // redirections only, e.g. `> f`
+            finish_stage();
+            cmd = nullptr;
+            if (t.kind == token::PIPE) continue;
+        } else if (t.kind == token::PIPE || (p == nullptr && t.kind != token::END)) {
+            return syntax_error(t);
+        } else if (p != nullptr && !(p->timed && p->stage_count == 0 && t.kind != token::AMP)) {
+            // `a | ;` or `a |` at the end of line; a bare `time` is a pipeline of its own
+            return syntax_error(t);
         }
-        setpgid(pid, leader_pid);       // the parent calls setpgid again to avoid timing problems
-        if (first_process) {
-            tcsetpgrp(STDIN_FILENO, leader_pid);
-            kill(pid, SIGCONT);         // mitigate race
-            first_process = false;
+        if (t.kind == token::END) break;
+        if (t.kind == token::AMP) p->background = true;
+        p = nullptr;
+    }
+
+    // the bodies follow the line in the order the heredocs appear in it
+    for (auto &entry : heredocs) {
+        redirection *r = entry.first;
+        std::string_view delimiter = r->target;
+        std::string body, text;
+        while (true) {
+            if (more == nullptr || !more->next(text)) {
+                std::cerr << "warning: here-document delimited by end-of-file (wanted `"
+                          << delimiter << "')" << std::endl;
+                break;
+            }
+            std::string_view l = text;
+            if (entry.second) l.remove_prefix(std::min(l.find_first_not_of('\t'), l.size()));
+            if (l == delimiter) break;
+            body.append(l);
+            body.push_back('\n');
         }
-        if (i != cmd_count - 1)
-            close(fds_next[1]); // we dont need the write port anymore
-        fds[0] = fds_next[0];   // pass on read port
+        r->target = mem.copy(body);
     }
+    out = head.next;
+    return true;
+}
 
-    // wait for subprocesses to finish
-    int status;
-    while (wait(&status) >= 0);
-    signal(SIGTTOU, SIG_IGN);
-    if (tcsetpgrp(STDIN_FILENO, getpgid(getpid())) < 0) {
-        // 不过好像这里设置前台失败的话，怎么输出错误信息都是没法看到的吧……
-        std::cerr << "set oneself as foreground process group failed: " << strerror(errno) << std::endl;
-        exit(255);
+// ---- pathname expansion ----
+
+// d_type comes with every entry, so most of a scan needs no stat() at all
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// fn(dirfd, name, d_type) for every entry but . and .., read with getdents64
+// in large batches; false if dir cannot be opened
+template <class F> static bool scan_dir(const char *dir, F fn) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    static std::vector<char> buf(256 * 1024);
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0) {
+        for (long off = 0; off < n;) {
+            auto *d = reinterpret_cast<linux_dirent64 *>(buf.data() + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            fn(fd, name, d->d_type);
+        }
     }
-    signal(SIGTTOU, SIG_DFL);
-    // tcsetattr(STDIN_FILENO, TCSAFLUSH, &settings);
+    close(fd);
+    return true;
 }
 
-void fork_and_exec(std::vector<std::string> &args) {
-    pid_t pid = fork();
+// `[...]` at pat[i]: 1 if c is in the class, 0 if not, -1 if the bracket is
+// not closed (then it is an ordinary character); i is moved past the `]`
+static int match_bracket(std::string_view pat, size_t &i, char c) {
+    size_t j = i + 1;
+    bool negate = j < pat.size() && (pat[j] == '!' || pat[j] == '^');
+    if (negate) ++j;
+    bool found = false;
+    for (bool first = true; j < pat.size(); first = false) {
+        if (pat[j] == ']' && !first) {
+            i = j + 1;
+            return found != negate;
+        }
+        char lo = pat[j];
+        if (lo == '\\' && j + 1 < pat.size()) lo = pat[++j];
+        char hi = lo;
+        if (j + 2 < pat.size() && pat[j + 1] == '-' && pat[j + 2] != ']') {
+            j += 2;
+            hi = pat[j];
+            if (hi == '\\' && j + 1 < pat.size()) hi = pat[++j];
+        }
+        if ((unsigned char)c >= (unsigned char)lo && (unsigned char)c <= (unsigned char)hi) found = true;
+        ++j;
+    }
+    return -1;
+}
 
-    char *arg_ptrs[args.size() + 1];
-    for (int i = 0; i < args.size(); i++) {
-        arg_ptrs[i] = &args[i][0];
+// one path component against one pattern component; a `*` that fails to
+// match further on is retried one character later, so this is O(n*m) at worst
+static bool glob_match(std::string_view pat, const char *name) {
+    // a leading dot has to be matched by a dot
+    if (name[0] == '.' && (pat.empty() || pat[0] != '.')) return false;
+    size_t p = 0, star_p = std::string_view::npos;
+    const char *n = name, *star_n = nullptr;
+    while (*n) {
+        if (p < pat.size()) {
+            char c = pat[p];
+            size_t q = p;
+            int r;
+            if (c == '*') {
+                star_p = ++p;
+                star_n = n;
+                continue;
+            }
+            if (c == '?') {
+                ++p;
+                ++n;
+                continue;
+            }
+            if (c == '[' && (r = match_bracket(pat, q, *n)) >= 0) {
+                if (r == 1) {
+                    p = q;
+                    ++n;
+                    continue;
+                }
+            } else {
+                if (c == '\\' && p + 1 < pat.size()) c = pat[++p];
+                if (c == *n) {
+                    ++p;
+                    ++n;
+                    continue;
+                }
+            }
+        }
+        if (star_p == std::string_view::npos) return false;
+        p = star_p;
+        n = ++star_n;
     }
-    arg_ptrs[args.size()] = nullptr;
+    while (p < pat.size() && pat[p] == '*') ++p;
+    return p == pat.size();
+}
 
-    if (pid == 0) {
-        execvp(args[0].c_str(), arg_ptrs);
-        std::cerr << "exec failed: " << strerror(errno) << '\n';
-        exit(255);
+static bool has_glob(std::string_view pat) {
+    for (size_t i = 0; i < pat.size(); ++i) {
+        if (pat[i] == '\\') ++i;
+        else if (pat[i] == '*' || pat[i] == '?' || pat[i] == '[') return true;
     }
+    return false;
+}
 
-    int status;
-    int retpid = wait(&status);
-    if (retpid < 0) {
-        std::cerr << "wait failed: " << strerror(errno) << '\n';
-    } else if (WIFEXITED(status)) {
-        // child process exited
-        if (WEXITSTATUS(status) == 255) {
-            std::cout << "child exec failed.\n";
+static std::string strip_escapes(std::string_view pat) {
+    std::string out;
+    for (size_t i = 0; i < pat.size(); ++i) {
+        if (pat[i] == '\\' && i + 1 < pat.size()) ++i;
+        out.push_back(pat[i]);
+    }
+    return out;
+}
+
+// walk the components of a pattern below dir; components without glob
+// characters are appended as they are, only the others cost a directory scan
+static void glob_walk(std::string &path, const std::vector<std::string_view> &comps, size_t k,
+                      bool want_dir, std::vector<std::string> &out) {
+    bool last = k + 1 == comps.size();
+    size_t len = path.size();
+    if (!path.empty() && path.back() != '/') path.push_back('/');
+    if (!has_glob(comps[k])) {
+        path += strip_escapes(comps[k]);
+        struct stat st;
+        if (!last) glob_walk(path, comps, k + 1, want_dir, out);
+        else if (lstat(path.c_str(), &st) == 0 && (!want_dir || S_ISDIR(st.st_mode)))
+            out.push_back(path + (want_dir ? "/" : ""));
+        path.resize(len);
+        return;
+    }
+    std::vector<std::string> matched;
+    bool dirs_only = !last || want_dir;
+    scan_dir(path.empty() ? "." : path.c_str(), [&](int fd, const char *name, unsigned char type) {
+        if (!glob_match(comps[k], name)) return;
+        if (dirs_only && type != DT_DIR) {
+            // a symlink may point at a directory, and some file systems do not fill in d_type
+            struct stat st;
+            if ((type != DT_LNK && type != DT_UNKNOWN) || fstatat(fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode))
+                return;
+        }
+        matched.push_back(name);
+    });
+    size_t base = path.size();
+    for (const std::string &name : matched) {
+        path += name;
+        if (!last) glob_walk(path, comps, k + 1, want_dir, out);
+        else out.push_back(path + (want_dir ? "/" : ""));
+        path.resize(base);
+    }
+    path.resize(len);
+}
+
+// the paths matching pat, sorted; none if nothing matches
+static std::vector<std::string> glob_expand(std::string_view pat) {
+    std::vector<std::string> out;
+    std::vector<std::string_view> comps;
+    std::string path = pat[0] == '/' ? "/" : "";
+    for (size_t i = 0; i < pat.size();) {
+        size_t slash = std::min(pat.find('/', i), pat.size());
+        if (slash > i) comps.push_back(pat.substr(i, slash - i));
+        i = slash + 1;
+    }
+    if (comps.empty()) return out;
+    glob_walk(path, comps, 0, pat.back() == '/', out);
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+// replace every glob word with the paths it matches; a word that matches
+// nothing stays as it is, like in sh
+void expand_globs(pipeline *p, arena &mem) {
+    for (command *c = p->stages; c; c = c->next) {
+        for (substitution *sub = c->substs; sub; sub = sub->next)
+            expand_globs(sub->body, mem);
+        if (c->patterns == nullptr) continue;
+        std::vector<char *> argv;
+        for (int i = 0; i < c->argc; ++i) {
+            std::vector<std::string> paths;
+            if (c->patterns[i]) paths = glob_expand(c->patterns[i]);
+            if (paths.empty()) {
+                argv.push_back(c->argv[i]);
+                continue;
+            }
+            for (const std::string &path : paths) argv.push_back(mem.copy(path));
         }
-    } else if (WIFSIGNALED(status)) {
-        ;
+        c->argc = argv.size();
+        c->argv = (char **)mem.alloc((argv.size() + 1) * sizeof(char *), alignof(char *));
+        std::copy(argv.begin(), argv.end(), c->argv);
+        c->argv[argv.size()] = nullptr;
+        // expanded once; a pipeline is not run twice
+        c->patterns = nullptr;
     }
 }
 
-std::string expand_hist(std::string in) {
-    if (in.length() <= 1) return in;
+// ---- completion ----
+
+// the executables in $PATH, for completing command names. a directory is
+// listed again only when its mtime has changed, i.e. an entry was added,
+// removed or renamed, so a Tab normally costs one stat() per PATH entry
+struct path_listing {
+    std::string dir;
+    bool listed = false;
+    struct timespec mtime = {};
+    std::vector<std::string> names;
+};
+static std::string completion_path;             // the $PATH the listings are for
+static std::vector<path_listing> path_listings;
+static std::vector<std::string> command_names;  // all of them and the builtins, sorted
+
+static void refresh_command_names() {
+    const char *env = getenv("PATH");
+    std::string_view dirs = env ? env : "/usr/local/bin:/usr/bin:/bin";
+    bool changed = false;
+    if (dirs != completion_path) {
+        completion_path = dirs;
+        path_listings.clear();
+        while (true) {
+            size_t colon = dirs.find(':');
+            std::string_view dir = dirs.substr(0, colon);
+            path_listings.emplace_back();
+            path_listings.back().dir = dir.empty() ? "." : dir;
+            if (colon == std::string_view::npos) break;
+            dirs.remove_prefix(colon + 1);
+        }
+        changed = true;
+    }
+    for (path_listing &l : path_listings) {
+        struct stat st;
+        if (stat(l.dir.c_str(), &st) < 0) {
+            changed |= l.listed;
+            l.listed = false;
+            l.names.clear();
+            continue;
+        }
+        if (l.listed && st.st_mtim.tv_sec == l.mtime.tv_sec && st.st_mtim.tv_nsec == l.mtime.tv_nsec)
+            continue;
+        l.listed = true;
+        l.mtime = st.st_mtim;
+        l.names.clear();
+        changed = true;
+        scan_dir(l.dir.c_str(), [&](int fd, const char *name, unsigned char type) {
+            if (type == DT_DIR) return;
+            if (type != DT_REG && (fstatat(fd, name, &st, 0) < 0 || !S_ISREG(st.st_mode))) return;
+            if (faccessat(fd, name, X_OK, 0) == 0) l.names.push_back(name);
+        });
+    }
+    if (!changed) return;
+    command_names.assign(std::begin(builtin_names), std::end(builtin_names));
+    for (const path_listing &l : path_listings)
+        command_names.insert(command_names.end(), l.names.begin(), l.names.end());
+    std::sort(command_names.begin(), command_names.end());
+    command_names.erase(std::unique(command_names.begin(), command_names.end()), command_names.end());
+}
+
+static char *command_generator(const char *text, int state) {
+    static size_t next, len;
+    if (state == 0) {
+        refresh_command_names();
+        len = strlen(text);
+        next = std::lower_bound(command_names.begin(), command_names.end(), text) - command_names.begin();
+    }
+    if (next < command_names.size() && command_names[next].compare(0, len, text) == 0)
+        return strdup(command_names[next++].c_str());
+    return nullptr;
+}
+
+// the first word of a command is completed from $PATH, anything else (and
+// a word with a slash in it) is left to readline's filename completion
+char **complete_line(const char *text, int start, int end) {
+    int i = start;
+    while (i > 0 && isspace(rl_line_buffer[i - 1])) --i;
+    if ((i > 0 && !strchr("|;&(", rl_line_buffer[i - 1])) || strchr(text, '/')) return nullptr;
+    return rl_completion_matches(text, command_generator);
+}
+
+std::string expand_hist(std::string_view in) {
+    if (in.length() <= 1) return std::string(in);
     std::string ret;
+    ret.reserve(in.length());
+#ifdef USE_CUSTOM_HISTORY
+    bool found = true;
+    auto append_entry = [&](int n) {
+        if (n >= 1 && history.has(n - 1)) {
+            ret.append(history.at(n - 1));
+        } else {
+            std::cerr << "!" << n << ": event not found" << std::endl;
+            found = false;
+        }
+    };
+#endif
     // use a state machine to do the substitution...
     char prev = '\0';
     bool in_number = false;
@@ -438,7 +2275,12 @@ std::string expand_hist(std::string in) {
 #ifndef USE_CUSTOM_HISTORY
                 ret.append(history_get(history_length - 1)->line);
 #else
-                ret.append(*history_lines.rbegin());
+                if (history.has_from_end(0)) {
+                    ret.append(history.from_end(0));
+                } else {
+                    std::cerr << "!!: event not found" << std::endl;
+                    found = false;
+                }
 #endif
             } else if (isdigit(in[i])) {
                 now_number = now_number * 10 + (in[i] - '0');
@@ -446,7 +2288,7 @@ std::string expand_hist(std::string in) {
 #ifndef USE_CUSTOM_HISTORY
                 ret.append(history_get(now_number)->line);
 #else
-                ret.append(history_lines[now_number - 1]);
+                append_entry(now_number);
 #endif
                 ret.push_back(in[i]);
                 in_number = false;
@@ -467,81 +2309,263 @@ std::string expand_hist(std::string in) {
 #ifndef USE_CUSTOM_HISTORY
             ret.append(history_get(now_number)->line);
 #else
-            ret.append(history_lines[now_number - 1]);
+            append_entry(now_number);
 #endif
         }
     }
+#ifdef USE_CUSTOM_HISTORY
+    if (!found) return std::string();
+#endif
     return ret;
 }
 
-// remove duplicate spaces
-std::string sanitize(std::string in) {
-    std::string ret;
-    while (in.length() && isspace(in[0]))
-        in = in.substr(1);
-    while (in.length() && isspace(*in.rbegin()))
-        in.erase(in.size() - 1);
-    if (!in.length()) return ret;
-    ret.push_back(in[0]);
-    for (int i = 1; i < in.length(); ++i) {
-        if (isspace(in[i - 1]) && isspace(in[i])) continue;
-        ret.push_back(in[i]);
-    }
-    return ret;
-}
-
-// 经典的 cpp string split 实现
-// https://stackoverflow.com/a/14266139/11691878
-std::vector<std::string> split(std::string s, const std::string &delimiter) {
-    std::vector<std::string> res;
-    if (s.length() == 0) return res;
-    size_t pos = 0;
-    std::string token;
-    while ((pos = s.find(delimiter)) != std::string::npos) {
-        token = s.substr(0, pos);
-        res.push_back(token);
-        s = s.substr(pos + delimiter.length());
-    }
-    res.push_back(s);
-    return res;
+// strip leading and trailing spaces, the lexer takes care of the rest
+std::string_view sanitize(std::string_view in) {
+    size_t begin = 0, end = in.size();
+    while (begin < end && isspace(in[begin])) ++begin;
+    while (end > begin && isspace(in[end - 1])) --end;
+    return in.substr(begin, end - begin);
 }
 
 int arrow_function(int p, int q) {
     if (q == 'A') {
         // up arrow
-        if (current_position_in_history != 0) {
+        if (history.has_from_end(history_browse)) {
             rl_delete_text(0, rl_end);
             rl_point = 0;
-            current_position_in_history--;
-            rl_insert_text(history_lines[current_position_in_history].c_str());
+            rl_insert_text(std::string(history.from_end(history_browse)).c_str());
+            history_browse++;
         }
     } else {
         // down arrow
-        if (current_position_in_history < history_lines.size() - 1) {
+        if (history_browse > 1) {
             rl_delete_text(0, rl_end);
             rl_point = 0;
-            current_position_in_history++;
-            rl_insert_text(history_lines[current_position_in_history].c_str());
+            history_browse--;
+            rl_insert_text(std::string(history.from_end(history_browse - 1)).c_str());
         }
     }
     return 0;
 }
 
-void my_readhist(const char *fname) {
-    std::ifstream fin(fname);
-    std::string str;
-    if (!fin) return;
-    while (std::getline(fin, str)) {
-        history_lines.push_back(str);
+static uint32_t trigram(const char *s) {
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+static void index_trigrams(std::unordered_map<uint32_t, std::vector<uint32_t>> &index,
+                           uint32_t id, std::string_view line) {
+    for (size_t i = 0; i + 3 <= line.size(); ++i) {
+        std::vector<uint32_t> &list = index[trigram(line.data() + i)];
+        if (list.empty() || list.back() != id) list.push_back(id);
+    }
+}
+
+// the shortest posting list among the trigrams of the query,
+// nullptr if one of them does not occur at all
+static const std::vector<uint32_t> *rarest_list(
+        const std::unordered_map<uint32_t, std::vector<uint32_t>> &index, std::string_view query) {
+    const std::vector<uint32_t> *rarest = nullptr;
+    for (size_t i = 0; i + 3 <= query.size(); ++i) {
+        auto it = index.find(trigram(query.data() + i));
+        if (it == index.end()) return nullptr;
+        if (rarest == nullptr || it->second.size() < rarest->size()) rarest = &it->second;
     }
-    current_position_in_history = history_lines.size();
+    return rarest;
+}
+
+void history_store::open(const char *fname) {
+    // O_APPEND keeps the writes of concurrent shells whole and in order
+    fd = ::open(fname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return;
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;
+    map = (const char *)p;
+    map_len = scanned = st.st_size;
 }
 
-int my_writehist(const char *fname) {
-    std::ofstream fout(fname);
-    if (!fout) return -1;
-    for (auto s : history_lines) {
-        fout << s << std::endl;
+// index the `count` most recent lines of the file (or all of them)
+void history_store::index_back(size_t count) {
+    while (starts.size() < count && scanned > 0) {
+        size_t end = scanned;
+        if (map[end - 1] == '\n') --end;
+        const char *nl = end ? (const char *)memrchr(map, '\n', end) : nullptr;
+        size_t start = nl ? nl - map + 1 : 0;
+        scanned = start;
+        if (start != end) starts.push_back(start);     // skip empty lines
     }
+    if (scanned == 0) file_lines = starts.size();
+}
+
+// index the `count` oldest lines of the file (or all of them)
+void history_store::index_front(size_t count) {
+    while (fronts.size() < count && front_scanned < map_len) {
+        size_t start = front_scanned;
+        const char *nl = (const char *)memchr(map + start, '\n', map_len - start);
+        size_t end = nl ? nl - map : map_len;
+        front_scanned = nl ? end + 1 : map_len;
+        if (start != end) fronts.push_back(start);
+    }
+    if (front_scanned == map_len) file_lines = fronts.size();
+}
+
+// the number of lines in the file, counted once without indexing them
+size_t history_store::file_size() {
+    if (file_lines == SIZE_MAX) {
+        size_t lines = 0;
+        for (size_t start = 0; start < map_len;) {
+            const char *nl = (const char *)memchr(map + start, '\n', map_len - start);
+            size_t end = nl ? nl - map : map_len;
+            lines += start != end;
+            start = end + 1;
+        }
+        file_lines = lines;
+    }
+    return file_lines;
+}
+
+std::string_view history_store::line_at(size_t start) const {
+    const char *nl = (const char *)memchr(map + start, '\n', map_len - start);
+    return std::string_view(map + start, (nl ? nl - map : map_len) - start);
+}
+
+void history_store::append(std::string_view line) {
+    session.emplace_back(line);
+    index_trigrams(session_trigrams, session.size() - 1, line);
+    if (fd < 0) return;
+    // one write() per command, so a crash loses at most the command being typed
+    std::string record(line);
+    record.push_back('\n');
+    if (write(fd, record.data(), record.size()) < 0) {
+        perror("cannot write history file");
+    }
+}
+
+size_t history_store::size() {
+    return file_size() + session.size();
+}
+
+bool history_store::has(size_t i) {
+    index_front(i + 1);
+    // past the indexed lines the whole file has been scanned, file_lines == fronts.size()
+    return i < fronts.size() || i - fronts.size() < session.size();
+}
+
+bool history_store::has_from_end(size_t k) {
+    if (k < session.size()) return true;
+    k -= session.size();
+    index_back(k + 1);
+    return k < starts.size();
+}
+
+std::string_view history_store::from_end(size_t k) {
+    if (k < session.size()) return session[session.size() - 1 - k];
+    k -= session.size();
+    index_back(k + 1);
+    return file_line(k);
+}
+
+std::string_view history_store::at(size_t i) {
+    index_front(i + 1);
+    if (i < fronts.size()) return line_at(fronts[i]);
+    return session[i - fronts.size()];
+}
+
+// index the next chunk of older file lines, false once the whole file is indexed
+bool history_store::index_older_trigrams() {
+    size_t target = trigrams_indexed + 4096;
+    index_back(target);
+    if (trigrams_indexed >= starts.size()) return false;
+    for (; trigrams_indexed < std::min(target, starts.size()); ++trigrams_indexed)
+        index_trigrams(file_trigrams, trigrams_indexed, file_line(trigrams_indexed));
+    return true;
+}
+
+// the most recent entry, at from_end() position `from` or older, that contains
+// query, -1 if none. the search costs as much as how far back the match is
+long history_store::search(std::string_view query, size_t from) {
+    if (query.size() < 3) {
+        // short queries match almost everything, a backward scan stops early
+        for (size_t k = from; has_from_end(k); ++k)
+            if (from_end(k).find(query) != std::string_view::npos) return k;
+        return -1;
+    }
+
+    // every candidate from a posting list still has to contain the whole query
+    size_t n = session.size();
+    if (from < n) {
+        if (const std::vector<uint32_t> *list = rarest_list(session_trigrams, query)) {
+            auto end = std::upper_bound(list->begin(), list->end(), (uint32_t)(n - 1 - from));
+            while (end != list->begin()) {
+                --end;
+                if (session[*end].find(query) != std::string_view::npos) return n - 1 - *end;
+            }
+        }
+        from = n;
+    }
+    for (size_t k = from - n;;) {
+        if (const std::vector<uint32_t> *list = rarest_list(file_trigrams, query)) {
+            for (auto it = std::lower_bound(list->begin(), list->end(), (uint32_t)k); it != list->end(); ++it)
+                if (file_line(*it).find(query) != std::string_view::npos) return n + *it;
+        }
+        // nothing in what is indexed so far: go further back
+        k = std::max(k, trigrams_indexed);
+        if (!index_older_trigrams()) return -1;
+    }
+}
+
+// Ctrl-R: incremental search backwards through the history
+//   typing refines the query, Ctrl-R jumps to the next older match,
+//   Ctrl-G restores the original line, any other key accepts the match and is executed
+int reverse_search_function(int count, int key) {
+    std::string saved(rl_line_buffer);
+    int saved_point = rl_point;
+    std::string query, line = saved;
+    long found = -1;
+    bool failed = false;
+
+    auto search = [&](size_t from) {
+        long k = history.search(query, from);
+        failed = k < 0;
+        if (!failed) {
+            found = k;
+            line = history.from_end(k);
+        }
+    };
+
+    while (true) {
+        rl_replace_line(line.c_str(), 0);
+        size_t pos = query.empty() ? std::string::npos : line.find(query);
+        rl_point = pos == std::string::npos ? rl_end : pos;
+        rl_message("(%sreverse-i-search)`%s': ", failed ? "failed " : "", query.c_str());
+
+        int c = rl_read_key();
+        if (c == CTRL('R')) {
+            if (!query.empty()) search(found >= 0 ? found + 1 : 0);
+        } else if (c == CTRL('G')) {
+            line = saved;
+            rl_replace_line(line.c_str(), 0);
+            rl_point = saved_point;
+            break;
+        } else if (c == RUBOUT || c == CTRL('H')) {
+            if (!query.empty()) query.pop_back();
+            found = -1;
+            if (query.empty()) {
+                line = saved;
+                failed = false;
+            } else {
+                search(0);
+            }
+        } else if (isprint(c)) {
+            query.push_back(c);
+            // the current match may still contain the longer query
+            search(found >= 0 ? found : 0);
+        } else {
+            rl_execute_next(c);
+            break;
+        }
+    }
+    rl_clear_message();
     return 0;
-}
\ No newline at end of file
+}
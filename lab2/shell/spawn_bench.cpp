@@ -0,0 +1,53 @@
+// microbenchmark: fork()+execvp() against posix_spawnp() from a process with a big heap,
+// which is what the shell looks like after loading a long history
+// usage: ./spawn_bench [heap MB] [iterations]
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static char *argv_true[] = {(char *)"true", nullptr};
+
+static void run_fork() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv_true[0], argv_true);
+        _exit(255);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+static void run_spawn() {
+    pid_t pid;
+    if (posix_spawnp(&pid, argv_true[0], nullptr, nullptr, argv_true, environ) == 0)
+        waitpid(pid, nullptr, 0);
+}
+
+template <class F>
+static double bench(F f, int iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) f();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char **argv) {
+    size_t heap_mb = argc > 1 ? atol(argv[1]) : 256;
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+
+    // touch every page so that fork() has page tables to copy
+    std::vector<char> heap(heap_mb << 20);
+    memset(heap.data(), 1, heap.size());
+
+    printf("heap %zu MB, %d iterations\n", heap_mb, iterations);
+    printf("fork+exec   %8.1f us/spawn\n", bench(run_fork, iterations));
+    printf("posix_spawn %8.1f us/spawn\n", bench(run_spawn, iterations));
+    return heap[heap.size() / 2] != 1;
+}
@@ -0,0 +1,325 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/ptrace.h>
+
+namespace {
+
+#define MAX_DEPTH 128
+
+struct symbol {
+    uint64_t addr, size;
+    std::string name;       // as in the symbol table, demangled when used
+    bool operator<(const symbol &other) const { return addr < other.addr; }
+};
+
+// what the profiler needs from an ELF file: where the loadable segments are
+// in the file, to turn a file offset into a link-time address, and the
+// function symbols sorted by address
+struct elf_image {
+    struct segment {
+        uint64_t offset, vaddr, filesz;
+    };
+    std::vector<segment> segments;
+    std::vector<symbol> symbols;
+
+    bool to_vaddr(uint64_t offset, uint64_t &vaddr) const {
+        for (const segment &s : segments) {
+            if (offset >= s.offset && offset < s.offset + s.filesz) {
+                vaddr = offset - s.offset + s.vaddr;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // symbols without a size (hand-written assembly) cover everything up to the next one
+    const symbol *lookup(uint64_t vaddr) const {
+        symbol key = {vaddr, 0, std::string()};
+        auto it = std::upper_bound(symbols.begin(), symbols.end(), key);
+        if (it == symbols.begin()) return nullptr;
+        --it;
+        if (it->size != 0 && vaddr >= it->addr + it->size) return nullptr;
+        return &*it;
+    }
+};
+
+// an executable mapping of a process
+struct mapping {
+    uint64_t start, end, offset;
+    std::string path;
+    const elf_image *image;     // nullptr for [vdso], anonymous memory, unreadable files
+};
+
+struct process {
+    bool loaded = false;
+    std::vector<mapping> maps;                          // sorted by start
+    std::unordered_map<uint64_t, std::string> names;    // frame address -> frame name
+};
+
+struct thread {
+    pid_t tgid;
+    std::string comm;
+};
+
+// the same libraries show up in every process, so images are shared
+std::map<std::string, std::unique_ptr<elf_image>> images;
+std::map<pid_t, process> processes;
+std::map<pid_t, thread> threads;
+std::map<std::string, unsigned long> stacks;    // folded stack -> samples
+unsigned long samples = 0;
+
+bool in_file(size_t size, uint64_t off, uint64_t len) {
+    return off <= size && len <= size - off;
+}
+
+void parse_elf(const char *data, size_t size, elf_image &img) {
+    if (size < sizeof(Elf64_Ehdr) || memcmp(data, ELFMAG, SELFMAG) != 0 || data[EI_CLASS] != ELFCLASS64)
+        return;
+    const Elf64_Ehdr *eh = reinterpret_cast<const Elf64_Ehdr *>(data);
+    if (in_file(size, eh->e_phoff, uint64_t(eh->e_phnum) * sizeof(Elf64_Phdr))) {
+        const Elf64_Phdr *ph = reinterpret_cast<const Elf64_Phdr *>(data + eh->e_phoff);
+        for (int i = 0; i < eh->e_phnum; ++i) {
+            if (ph[i].p_type == PT_LOAD)
+                img.segments.push_back({ph[i].p_offset, ph[i].p_vaddr, ph[i].p_filesz});
+        }
+    }
+    if (!in_file(size, eh->e_shoff, uint64_t(eh->e_shnum) * sizeof(Elf64_Shdr))) return;
+    const Elf64_Shdr *sh = reinterpret_cast<const Elf64_Shdr *>(data + eh->e_shoff);
+    // .symtab has everything, stripped files only have .dynsym
+    const Elf64_Shdr *symtab = nullptr;
+    for (int i = 0; i < eh->e_shnum; ++i) {
+        if (sh[i].sh_type == SHT_SYMTAB || (sh[i].sh_type == SHT_DYNSYM && symtab == nullptr))
+            symtab = &sh[i];
+    }
+    if (symtab == nullptr || symtab->sh_link >= eh->e_shnum) return;
+    const Elf64_Shdr *strtab = &sh[symtab->sh_link];
+    if (!in_file(size, symtab->sh_offset, symtab->sh_size) || !in_file(size, strtab->sh_offset, strtab->sh_size))
+        return;
+    const Elf64_Sym *sym = reinterpret_cast<const Elf64_Sym *>(data + symtab->sh_offset);
+    size_t count = symtab->sh_size / sizeof(Elf64_Sym);
+    const char *str = data + strtab->sh_offset;
+    for (size_t i = 0; i < count; ++i) {
+        int type = ELF64_ST_TYPE(sym[i].st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) || sym[i].st_shndx == SHN_UNDEF ||
+            sym[i].st_value == 0 || sym[i].st_name >= strtab->sh_size)
+            continue;
+        const char *name = str + sym[i].st_name;
+        img.symbols.push_back({sym[i].st_value, sym[i].st_size,
+                               std::string(name, strnlen(name, strtab->sh_size - sym[i].st_name))});
+    }
+    std::stable_sort(img.symbols.begin(), img.symbols.end());
+    // aliases share an address, keep one of them
+    img.symbols.erase(std::unique(img.symbols.begin(), img.symbols.end(),
+                                  [](const symbol &a, const symbol &b) { return a.addr == b.addr; }),
+                      img.symbols.end());
+}
+
+const elf_image *load_image(const std::string &path) {
+    auto it = images.find(path);
+    if (it != images.end()) return it->second.get();
+    std::unique_ptr<elf_image> img(new elf_image);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            parse_elf(static_cast<const char *>(data), st.st_size, *img);
+            munmap(data, st.st_size);
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (img->segments.empty()) img.reset();
+    const elf_image *result = img.get();
+    images[path] = std::move(img);
+    return result;
+}
+
+void read_maps(pid_t tgid, process &p) {
+    p.loaded = true;
+    p.maps.clear();
+    p.names.clear();
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", tgid);
+    FILE *f = fopen(path, "re");
+    if (f == nullptr) return;
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        unsigned long start, end, offset;
+        char perms[5];
+        int name_at = 0;
+        if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n", &start, &end, perms, &offset, &name_at) < 4 ||
+            perms[2] != 'x')
+            continue;
+        mapping m = {start, end, offset, name_at > 0 ? line + name_at : "", nullptr};
+        const char *deleted = " (deleted)";
+        if (m.path.size() > strlen(deleted) &&
+            m.path.compare(m.path.size() - strlen(deleted), std::string::npos, deleted) == 0)
+            m.path.resize(m.path.size() - strlen(deleted));
+        if (!m.path.empty() && m.path[0] == '/') m.image = load_image(m.path);
+        p.maps.push_back(m);
+    }
+    free(line);
+    fclose(f);
+    std::sort(p.maps.begin(), p.maps.end(),
+              [](const mapping &a, const mapping &b) { return a.start < b.start; });
+}
+
+const mapping *find_mapping(const process &p, uint64_t addr) {
+    auto it = std::upper_bound(p.maps.begin(), p.maps.end(), addr,
+                               [](uint64_t a, const mapping &m) { return a < m.start; });
+    if (it == p.maps.begin()) return nullptr;
+    --it;
+    return addr < it->end ? &*it : nullptr;
+}
+
+std::string demangle(const std::string &name) {
+    int status;
+    char *s = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (s == nullptr) return name;
+    std::string result(s);
+    free(s);
+    return result;
+}
+
+// function name, or file+offset when the file has no symbol for it
+const std::string &frame_name(process &p, const mapping &m, uint64_t addr) {
+    auto it = p.names.find(addr);
+    if (it != p.names.end()) return it->second;
+    std::string &name = p.names[addr];
+    uint64_t offset = addr - m.start + m.offset, vaddr;
+    const symbol *sym = nullptr;
+    if (m.image != nullptr && m.image->to_vaddr(offset, vaddr)) sym = m.image->lookup(vaddr);
+    if (sym != nullptr) {
+        name = demangle(sym->name);
+    } else if (m.path.empty()) {
+        name = "[unknown]";
+    } else {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "+0x%llx", (unsigned long long)offset);
+        size_t slash = m.path.rfind('/');
+        name = (slash == std::string::npos ? m.path : m.path.substr(slash + 1)) + buf;
+    }
+    return name;
+}
+
+// the return addresses found by following the saved frame pointers, which
+// needs code built with -fno-omit-frame-pointer; elsewhere the walk stops at
+// the first frame that does not look like one, and the sample is just shorter
+int unwind(pid_t tid, uint64_t *pcs) {
+    struct user_regs_struct regs;
+    if (ptrace(PTRACE_GETREGS, tid, 0, &regs) < 0) return 0;
+    int n = 0;
+    pcs[n++] = regs.rip;
+    uint64_t fp = regs.rbp, sp = regs.rsp;
+    while (n < MAX_DEPTH) {
+        // callers' frames lie above, at higher addresses
+        if (fp < sp || (fp & 7) != 0) break;
+        uint64_t frame[2];     // saved rbp, return address
+        struct iovec local = {frame, sizeof(frame)};
+        struct iovec remote = {reinterpret_cast<void *>(fp), sizeof(frame)};
+        if (process_vm_readv(tid, &local, 1, &remote, 1, 0) != ssize_t(sizeof(frame)) || frame[1] == 0)
+            break;
+        pcs[n++] = frame[1];
+        sp = fp + sizeof(frame);
+        fp = frame[0];
+    }
+    return n;
+}
+
+thread *find_thread(pid_t tid) {
+    auto it = threads.find(tid);
+    if (it != threads.end()) return &it->second;
+    char path[64], buf[256], name[256];
+    thread t = {0, std::string()};
+    snprintf(path, sizeof(path), "/proc/%d/status", tid);
+    FILE *f = fopen(path, "re");
+    if (f == nullptr) return nullptr;
+    while (fgets(buf, sizeof(buf), f) != nullptr) {
+        if (sscanf(buf, "Name: %255[^\n]", name) == 1) t.comm = name;
+        else if (sscanf(buf, "Tgid: %d", &t.tgid) == 1) break;
+    }
+    fclose(f);
+    if (t.tgid <= 0) return nullptr;
+    // spaces are fine in the folded format, semicolons separate frames
+    std::replace(t.comm.begin(), t.comm.end(), ';', '_');
+    return &(threads[tid] = t);
+}
+
+}
+
+void profile_sample(pid_t tid) {
+    uint64_t pcs[MAX_DEPTH];
+    int n = unwind(tid, pcs);
+    thread *t = find_thread(tid);
+    if (n == 0 || t == nullptr) return;
+    process &p = processes[t->tgid];
+    // code that is running is mapped: a miss means dlopen() or the like
+    if (!p.loaded || find_mapping(p, pcs[0]) == nullptr) read_maps(t->tgid, p);
+
+    const std::string *names[MAX_DEPTH];
+    int depth = 0;
+    for (int i = 0; i < n; ++i) {
+        // a return address points after the call, which may be another function
+        uint64_t addr = i == 0 ? pcs[i] : pcs[i] - 1;
+        const mapping *m = find_mapping(p, addr);
+        if (m == nullptr) {
+            if (i > 0) break;   // not a return address, the frame chain ended
+            static const std::string unknown = "[unknown]";
+            names[depth++] = &unknown;
+            continue;
+        }
+        names[depth++] = &frame_name(p, *m, addr);
+    }
+    std::string folded = t->comm;
+    while (depth > 0) {
+        folded += ';';
+        folded += *names[--depth];
+    }
+    ++stacks[folded];
+    ++samples;
+}
+
+void profile_exec(pid_t tid) {
+    threads.erase(tid);
+    processes.erase(tid);   // after execve the thread is the group leader
+}
+
+void profile_exit(pid_t tid) {
+    threads.erase(tid);
+    // other threads may outlive the leader; their next sample reads the maps again
+    processes.erase(tid);
+}
+
+unsigned long profile_write(FILE *out) {
+    std::vector<std::pair<unsigned long, const std::string *>> sorted;
+    for (auto &s : stacks) sorted.push_back({s.second, &s.first});
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<unsigned long, const std::string *> &a,
+                        const std::pair<unsigned long, const std::string *> &b) { return a.first > b.first; });
+    for (auto &s : sorted) fprintf(out, "%s %lu\n", s.second->c_str(), s.first);
+    fflush(out);
+    return samples;
+}
@@ -0,0 +1,21 @@
+// sampling profiler for --profile: the main loop stops a thread with
+// PTRACE_INTERRUPT, calls profile_sample() while it is stopped and lets it go.
+// stacks are unwound by following frame pointers and symbolized with the
+// symbol tables of the mapped ELF files, the result is written in the folded
+// format of flamegraph.pl ("comm;outer;...;inner count" per line)
+#ifndef STRACE_PROFILE_H
+#define STRACE_PROFILE_H
+
+#include <cstdio>
+#include <sys/types.h>
+
+// one stack sample of a thread in a ptrace-stop
+void profile_sample(pid_t tid);
+// the thread called execve: its process has new mappings and a new name
+void profile_exec(pid_t tid);
+// the thread is gone
+void profile_exit(pid_t tid);
+// all stacks seen so far, most frequent first; returns the number of samples
+unsigned long profile_write(FILE *out);
+
+#endif
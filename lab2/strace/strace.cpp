@@ -1,45 +1,395 @@
+#include <map>
+#include <vector>
+
 #include <cstdio>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+
+#include <ctime>
 
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/ptrace.h>
 
-int main(int argc, char **argv) {
+#include "profile.h"
+
+// per-thread tracing state
+struct tracee {
+    bool have_entry = false;    // syscall entry seen, waiting for exit
+    bool silent = false;        // launched child before its execve
+    bool skip_exit = false;     // swallow the exit of the execve that started us
+    bool sample_pending = false; // interrupted by the profiler, sample at the next stop
+    unsigned long long nr = 0;
+    unsigned long long args[6] = {};
+};
+
+std::map<pid_t, tracee> tracees;
+bool attach_mode = false;
+bool profiling = false;
+
+volatile sig_atomic_t stop_requested = 0;
+static void stop_handler(int sig) {
+    stop_requested = 1;
+}
+
+volatile sig_atomic_t sample_requested = 0;
+static void sample_handler(int sig) {
+    sample_requested = 1;
+}
+
+// only there to make sigsuspend() return when a tracee changes state
+static void child_handler(int sig) {
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-l SECONDS] [--profile HZ] PROG [ARGS...]\n"
+                    "       %s [-l SECONDS] [--profile HZ] -p PID[,PID...]\n", prog, prog);
+    exit(1);
+}
+
+static const long trace_options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
+
+// PTRACE_SEIZE leaves the thread running, PTRACE_INTERRUPT makes it report
+// a PTRACE_EVENT_STOP, after which the main loop switches it to PTRACE_SYSCALL
+static bool seize_thread(pid_t tid, long options) {
+    if (tracees.count(tid)) return true;
+    if (ptrace(PTRACE_SEIZE, tid, 0, options) < 0) {
+        fprintf(stderr, "cannot attach to %d: %s\n", tid, strerror(errno));
+        return false;
+    }
+    tracees[tid];
+    ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+    return true;
+}
+
+// attach to every thread listed in /proc/pid/task
+// threads spawned by already seized threads are caught by PTRACE_O_TRACECLONE,
+// but a thread may appear between readdir() and the seize of its creator, hence the rescan
+static bool attach_process(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    bool any = false, found_new = true;
+    while (found_new) {
+        found_new = false;
+        DIR *dir = opendir(path);
+        if (dir == nullptr) {
+            fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+            return any;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != nullptr) {
+            pid_t tid = atoi(ent->d_name);
+            if (tid <= 0 || tracees.count(tid)) continue;
+            if (seize_thread(tid, trace_options)) {
+                any = found_new = true;
+            }
+        }
+        closedir(dir);
+    }
+    return any;
+}
+
+static pid_t launch(char **argv) {
+    // the child waits on a pipe until it has been seized,
+    // so that the execve and everything after it is traced
+    int go[2];
+    if (pipe2(go, O_CLOEXEC) < 0) exit(1);
     pid_t pid = fork();
     switch (pid) {
     case -1:
         exit(1);
-    case 0:
-        ptrace(PTRACE_TRACEME, 0, 0, 0);
-        execvp(argv[1], argv + 1);
+    case 0: {
+        char c;
+        close(go[1]);
+        while (read(go[0], &c, 1) < 0 && errno == EINTR);
+        execvp(argv[0], argv);
+        perror("exec");
         exit(1);
     }
-    waitpid(pid, 0, 0);
-    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_EXITKILL);
+    }
+    close(go[0]);
+    if (!seize_thread(pid, trace_options | PTRACE_O_EXITKILL)) exit(1);
+    tracees[pid].silent = true;
+    close(go[1]);
+    return pid;
+}
+
+static void print_prefix(pid_t tid) {
+    if (attach_mode || tracees.size() > 1)
+        fprintf(stderr, "[pid %5d] ", tid);
+}
+
+static void handle_syscall_stop(pid_t tid) {
+    tracee &t = tracees[tid];
+    struct __ptrace_syscall_info info;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) <= 0) return;
+
+    if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        t.have_entry = true;
+        t.nr = info.entry.nr;
+        memcpy(t.args, info.entry.args, sizeof(t.args));
+    } else if (info.op == PTRACE_SYSCALL_INFO_EXIT) {
+        if (t.silent) return;
+        if (t.skip_exit) {
+            t.skip_exit = false;
+            t.have_entry = false;
+            return;
+        }
+        // a line is printed only when the syscall returns,
+        // so output of different threads does not interleave
+        print_prefix(tid);
+        if (t.have_entry) {
+            fprintf(stderr, "%llu(%lld, %lld, %lld, %lld, %lld, %lld)", t.nr,
+                    (long long)t.args[0], (long long)t.args[1], (long long)t.args[2],
+                    (long long)t.args[3], (long long)t.args[4], (long long)t.args[5]);
+        } else {
+            // attached while the thread was inside a syscall
+            fprintf(stderr, "<... resumed>");
+        }
+        fprintf(stderr, " = %lld\n", (long long)info.exit.rval);
+        t.have_entry = false;
+    }
+}
+
+// a CPU profile: only threads that are running or runnable get sampled,
+// one blocked in a syscall or stopped is left alone
+static bool thread_running(pid_t tid) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", tid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    // the state follows the command name, which may contain anything
+    char *end = strrchr(buf, ')');
+    return end != nullptr && end[1] == ' ' && end[2] == 'R';
+}
+
+// one sampling round: every running thread gets a PTRACE_INTERRUPT and is
+// sampled when it reports the PTRACE_EVENT_STOP. a thread that has not
+// reported since the last round is not interrupted twice
+static void interrupt_running() {
+    for (auto &p : tracees) {
+        tracee &t = p.second;
+        if (t.silent || t.sample_pending || !thread_running(p.first)) continue;
+        if (ptrace(PTRACE_INTERRUPT, p.first, 0, 0) == 0) t.sample_pending = true;
+    }
+}
+
+static void forget(pid_t tid) {
+    if (profiling) profile_exit(tid);
+    auto it = tracees.find(tid);
+    if (it == tracees.end()) return;
+    tracee &t = it->second;
+    if (t.have_entry && !t.silent) {
+        // exit(), exit_group() and friends never return
+        print_prefix(tid);
+        fprintf(stderr, "%llu(%lld, %lld, %lld, %lld, %lld, %lld) = ?\n", t.nr,
+                (long long)t.args[0], (long long)t.args[1], (long long)t.args[2],
+                (long long)t.args[3], (long long)t.args[4], (long long)t.args[5]);
+    }
+    tracees.erase(it);
+}
+
+// stop every thread with PTRACE_INTERRUPT and let it go, re-injecting
+// a signal that was about to be delivered so the target does not lose it
+static void detach_all() {
+    for (auto &p : tracees) {
+        ptrace(PTRACE_INTERRUPT, p.first, 0, 0);
+    }
+    for (auto &p : tracees) {
+        pid_t tid = p.first;
+        int status;
+        while (true) {
+            if (waitpid(tid, &status, __WALL) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (!WIFSTOPPED(status)) break;     // exited meanwhile
+            int sig = WSTOPSIG(status);
+            long inject = 0;
+            if (sig != (SIGTRAP | 0x80) && (status >> 16) == 0 && sig != SIGTRAP)
+                inject = sig;
+            if (ptrace(PTRACE_DETACH, tid, 0, inject) < 0 && errno == ESRCH) {
+                // not in a ptrace-stop yet, e.g. a stop we already consumed
+                continue;
+            }
+            break;
+        }
+    }
+    tracees.clear();
+}
+
+int main(int argc, char **argv) {
+    std::vector<pid_t> pids;
+    long limit = 0, hz = 0;
+    static const struct option long_options[] = {
+        {"profile", required_argument, nullptr, 'P'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+p:l:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'p':
+            for (char *s = strtok(optarg, ","); s; s = strtok(nullptr, ",")) {
+                pid_t pid = atoi(s);
+                if (pid <= 0) usage(argv[0]);
+                pids.push_back(pid);
+            }
+            break;
+        case 'l':
+            limit = atol(optarg);
+            break;
+        case 'P':
+            hz = atol(optarg);
+            if (hz <= 0 || hz > 10000) usage(argv[0]);
+            profiling = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    attach_mode = !pids.empty();
+    if (attach_mode == (optind < argc)) usage(argv[0]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGALRM, &sa, nullptr);
+    if (profiling) {
+        sa.sa_handler = sample_handler;
+        sigaction(SIGPROF, &sa, nullptr);
+    }
+    sa.sa_handler = child_handler;
+    sigaction(SIGCHLD, &sa, nullptr);
+
+    if (attach_mode) {
+        bool any = false;
+        for (pid_t pid : pids)
+            any |= attach_process(pid);
+        if (!any) return 1;
+    } else {
+        launch(argv + optind);
+    }
+
+    // the main loop looks at the flags with these signals blocked and only
+    // lets them in inside sigsuspend(), so one arriving between the check
+    // and the wait is not lost until some tracee happens to stop.
+    // blocked after launch() so that the child does not inherit the mask
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGPROF);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+    sigdelset(&waitmask, SIGINT);
+    sigdelset(&waitmask, SIGTERM);
+    sigdelset(&waitmask, SIGALRM);
+    sigdelset(&waitmask, SIGPROF);
+    sigdelset(&waitmask, SIGCHLD);
+
+    if (limit > 0) alarm(limit);
+
+    // the sampling clock: SIGPROF, HZ times a second of wall time, wakes
+    // the main loop up so that it starts a round
+    timer_t timer;
+    if (profiling) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIGPROF;
+        long period = 1000000000L / hz;
+        struct itimerspec its = {{period / 1000000000L, period % 1000000000L},
+                                 {period / 1000000000L, period % 1000000000L}};
+        if (timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0 || timer_settime(timer, 0, &its, nullptr) < 0) {
+            perror("timer");
+            return 1;
+        }
+    }
+    // without --profile every thread runs from syscall stop to syscall stop
+    enum __ptrace_request resume = profiling ? PTRACE_CONT : PTRACE_SYSCALL;
 
-    struct user_regs_struct regs;
-    long syscall;
     int status;
+    while (!tracees.empty()) {
+        if (stop_requested) break;
+        if (sample_requested) {
+            sample_requested = 0;
+            interrupt_running();
+        }
+        pid_t tid = waitpid(-1, &status, __WALL | WNOHANG);
+        if (tid == 0) {
+            sigsuspend(&waitmask);
+            continue;
+        }
+        if (tid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            forget(tid);
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+        if (!tracees.count(tid)) {
+            // a new thread may report before its creator's PTRACE_EVENT_CLONE
+            tracees[tid];
+        }
 
-    while (true) {
-        // entering syscall
-        ptrace(PTRACE_SYSCALL, pid, 0, 0);
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) exit(0);
-        ptrace(PTRACE_GETREGS, pid, 0, &regs);
-        syscall = regs.orig_rax;
-        fprintf(stderr, "%ld(%ld, %ld, %ld, %ld, %ld, %ld)", syscall,
-                (long)regs.rdi, (long)regs.rsi, (long)regs.rdx,
-                (long)regs.r10, (long)regs.r8, (long)regs.r9);
-
-        // leaving syscall
-        ptrace(PTRACE_SYSCALL, pid, 0, 0);
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) exit(0);
-        ptrace(PTRACE_GETREGS, pid, 0, &regs);
-        fprintf(stderr, " = %ld\n", (long)regs.rax);
+        int sig = WSTOPSIG(status);
+        unsigned event = (unsigned)status >> 16;
+        long inject = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            handle_syscall_stop(tid);
+        } else if (event == PTRACE_EVENT_CLONE) {
+            unsigned long child;
+            ptrace(PTRACE_GETEVENTMSG, tid, 0, &child);
+            tracees[(pid_t)child];     // auto-attached, reports its own PTRACE_EVENT_STOP
+        } else if (event == PTRACE_EVENT_EXEC) {
+            tracee &t = tracees[tid];
+            if (profiling) profile_exec(tid);
+            if (t.silent) {
+                t.silent = false;
+                t.skip_exit = true;
+            }
+        } else if (event == PTRACE_EVENT_STOP) {
+            if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU) {
+                // group-stop: keep the thread stopped without resuming it
+                ptrace(PTRACE_LISTEN, tid, 0, 0);
+                continue;
+            }
+            // our own PTRACE_INTERRUPT
+            tracee &t = tracees[tid];
+            if (t.sample_pending) {
+                t.sample_pending = false;
+                profile_sample(tid);
+            }
+        } else if (event == 0) {
+            // signal-delivery-stop
+            inject = sig;
+        }
+        ptrace(resume, tid, 0, inject);
+    }
+
+    if (profiling) timer_delete(timer);
+    if (!tracees.empty()) {
+        detach_all();
+    }
+    if (profiling) {
+        unsigned long samples = profile_write(stdout);
+        fprintf(stderr, "%lu samples\n", samples);
     }
     return 0;
-}
\ No newline at end of file
+}
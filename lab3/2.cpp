@@ -3,7 +3,9 @@
 #include <cstdlib>
 #include <queue>
 #include <list>
+#include <vector>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -33,6 +35,12 @@ pthread_t workers[MAXN][2];
 bool online[MAXN];
 int fd_client[MAXN];
 
+// -c: the CPUs the threads of a client are pinned to, both to the same one so
+// that the queue between them stays in one cache; empty: the scheduler decides
+vector<int> cpus;
+size_t next_cpu = 0;
+int busy_poll = 0;      // -B: SO_BUSY_POLL in µs for the blocking recv()
+
 void my_bulk_send(int fd, const char *buf, size_t n, int flags) {
     size_t sent = 0;
     while (sent < n)
@@ -105,8 +113,77 @@ void *broadcast_msg(void *__id) {
     return NULL;
 }
 
+// "0-3,8" -> 0 1 2 3 8
+bool parse_cpus(const char *s) {
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0 || lo >= CPU_SETSIZE) return false;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo || hi >= CPU_SETSIZE) return false;
+        }
+        for (long c = lo; c <= hi; c++)
+            cpus.push_back(c);
+        if (*end == ',') end++;
+        else if (*end) return false;
+        s = end;
+    }
+    return !cpus.empty();
+}
+
+// the CPU the connection's packets have been processed on (SO_INCOMING_CPU,
+// i.e. the core serving its RX queue) if we may run there, otherwise the next
+// one in turn
+int pick_cpu(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        for (int c : cpus)
+            if (c == cpu) return cpu;
+    return cpus[next_cpu++ % cpus.size()];
+}
+
+void start_worker(pthread_t *thread, void *(*fn)(void *), void *arg, int cpu) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    // a CPU outside our cpuset makes it fail, run unpinned then
+    if (pthread_create(thread, &attr, fn, arg) != 0)
+        pthread_create(thread, NULL, fn, arg);
+    pthread_detach(*thread);
+    pthread_attr_destroy(&attr);
+}
+
 int main(int argc, char **argv) {
-    int port = atoi(argv[1]);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:B:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (!parse_cpus(optarg)) {
+                fprintf(stderr, "bad cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            busy_poll = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c cpu_list] [-B busy_poll_us] port\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-c cpu_list] [-B busy_poll_us] port\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[optind]);
     int fd;
     if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
         perror("socket");
@@ -140,10 +217,11 @@ int main(int argc, char **argv) {
             if (!online[i]) {
                 fd_client[i] = fd_tmp;
                 online[i] = true;
-                pthread_create(&workers[i][1], NULL, broadcast_msg, (void *)i);
-                pthread_detach(workers[i][1]);
-                pthread_create(&workers[i][0], NULL, receive_msg, (void *)i);
-                pthread_detach(workers[i][0]);
+                if (busy_poll > 0)
+                    setsockopt(fd_tmp, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+                int cpu = cpus.empty() ? -1 : pick_cpu(fd_tmp);
+                start_worker(&workers[i][1], broadcast_msg, (void *)i, cpu);
+                start_worker(&workers[i][0], receive_msg, (void *)i, cpu);
                 served = true;
                 break;
             }
@@ -51,48 +51,161 @@ void add_recv_request(struct io_uring *ring, int client_id, int len) {
     io_uring_submit(ring);
 }
 
+// per-client output. lines are appended to `pending` while `inflight` is being
+// sent; at most one send per client is outstanding, so the order is kept, and
+// everything queued meanwhile goes out together in the next one
+struct buffer {
+    char *data;
+    size_t len, cap;
+};
+
+struct out_queue {
+    struct buffer inflight, pending;
+    size_t off;         // bytes of inflight already sent
+    bool busy;          // a send is outstanding
+} outq[MAXN];
+
+void buffer_append(struct buffer *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = b->cap ? b->cap : 4096;
+        while (b->cap < b->len + len) b->cap *= 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// only prepared here, flush_sends() submits once for the whole round
 void add_send_request(struct io_uring *ring, int client_id, char *buf, int len) {
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
     struct req_tag *tag = malloc(sizeof(struct req_tag));
     tag->event_type = SEND;
     tag->client_id = client_id;
     tag->buf = buf;
     tag->len = len;
-    io_uring_prep_send(sqe, client_fds[client_id], tag->buf, len, 0);
+    io_uring_prep_send(sqe, client_fds[client_id], tag->buf, len, MSG_NOSIGNAL);
     io_uring_sqe_set_data(sqe, tag);
+}
+
+// start the next send of every idle client that has something queued
+void flush_sends(struct io_uring *ring) {
+    for (int i = 0; i < MAXN; i++) {
+        struct out_queue *q = &outq[i];
+        if (!online[i] || q->busy) continue;
+        if (q->off == q->inflight.len) {
+            // all sent: the pending buffer becomes the next send
+            struct buffer tmp = q->inflight;
+            q->inflight = q->pending;
+            q->pending = tmp;
+            q->pending.len = 0;
+            q->off = 0;
+        } else if (q->pending.len) {
+            // the rest of a short write, followed by what was queued meanwhile
+            memmove(q->inflight.data, q->inflight.data + q->off, q->inflight.len - q->off);
+            q->inflight.len -= q->off;
+            q->off = 0;
+            buffer_append(&q->inflight, q->pending.data, q->pending.len);
+            q->pending.len = 0;
+        }
+        if (q->off < q->inflight.len) {
+            add_send_request(ring, i, q->inflight.data + q->off, q->inflight.len - q->off);
+            q->busy = true;
+        }
+    }
     io_uring_submit(ring);
 }
 
+void send_complete(struct req_tag *tag, int res) {
+    struct out_queue *q = &outq[tag->client_id];
+    q->busy = false;
+    if (res < 0 || !online[tag->client_id]) {
+        // the peer is gone; the pending recv fails as well and closes it
+        if (online[tag->client_id]) shutdown(client_fds[tag->client_id], SHUT_RDWR);
+        q->inflight.len = q->pending.len = q->off = 0;
+        return;
+    }
+    // a short write continues from here in the next flush_sends()
+    q->off += res;
+}
+
 const char *header = "Message: ";
 
+void queue_line(int from, const char *line, int len) {
+    for (int i = 0; i < MAXN; i++) {
+        if (i == from || !online[i]) continue;
+        buffer_append(&outq[i].pending, header, 9);
+        buffer_append(&outq[i].pending, line, len);
+    }
+}
+
 void broadcast_messages(struct io_uring *ring, struct req_tag *orig) {
     int prev = 0;
     for (int i = 0; i < orig->len; i++)
         if (orig->buf[i] == '\n') {
-            int len = i - prev + 1;
-            char *buf = malloc(len + 10);
-            strcpy(buf, header);
-            strncpy(buf + 9, orig->buf + prev, len);
-            for (int i = 0; i < MAXN; i++) {
-                if (i == orig->client_id || !online[i]) continue;
-                char *sendbuf = strndup(buf, len + 9);
-                add_send_request(ring, i, sendbuf, len + 9);
-            }
-            free(buf);
+            queue_line(orig->client_id, orig->buf + prev, i - prev + 1);
             prev = i + 1;
         }
-    if (prev != orig->len) {
-        int len = orig->len - prev;
-        char *buf = malloc(len + 10);
-        strcpy(buf, header);
-        strncpy(buf + 9, orig->buf, len);
+    if (prev != orig->len)
+        queue_line(orig->client_id, orig->buf + prev, orig->len - prev);
+}
+
+void handle_completion(struct io_uring *ring, struct io_uring_cqe *cqe, int fd) {
+    struct req_tag *tag = (struct req_tag *)cqe->user_data;
+    if (tag == NULL) {
+        // was a close operation
+        return;
+    }
+    if (cqe->res < 0 && tag->event_type != SEND) {
+        fprintf(stderr, "Async request failed: %s for event: %d\n",
+                strerror(-cqe->res), tag->event_type);
+        // exit(1);
+    }
+    switch (tag->event_type) {
+    case ACCEPT: {
+        bool served = false;
+        int client_id = -1;
         for (int i = 0; i < MAXN; i++) {
-            if (i == orig->client_id || !online[i]) continue;
-            char *sendbuf = strndup(buf, len + 9);
-            add_send_request(ring, i, sendbuf, len + 9);
+            // a slot is reused only after the send of its last client has come back
+            if (!online[i] && !outq[i].busy) {
+                client_fds[i] = cqe->res;
+                online[i] = true;
+                client_id = i;
+                served = true;
+                break;
+            }
+        }
+        if (served) {
+            add_recv_request(ring, client_id, BUFLEN);
+        } else {
+            add_close_request(ring, cqe->res);
+        }
+        add_accept_request(ring, fd);
+        break;
+    }
+    case RECV:
+        if (cqe->res <= 0) {
+            // read zero bytes (or failed), client disconnect
+            add_close_request(ring, client_fds[tag->client_id]);
+            online[tag->client_id] = false;
+            outq[tag->client_id].inflight.len = outq[tag->client_id].pending.len = 0;
+            outq[tag->client_id].off = 0;
+        } else {
+            tag->len = cqe->res;    // actual message length
+            broadcast_messages(ring, tag);
+            add_recv_request(ring, tag->client_id, BUFLEN);
         }
-        free(buf);
+        free(tag->buf);
+        break;
+    case SEND:
+        // the buffer belongs to the client's queue
+        send_complete(tag, cqe->res);
+        break;
     }
+    free(tag);
 }
 
 int main(int argc, char **argv) {
@@ -120,65 +233,19 @@ int main(int argc, char **argv) {
     io_uring_queue_init(256, &ring, 0);
     struct io_uring_cqe *cqe;       // completion queue entry
 
-    // server loop
+    // server loop: handle every completion that is ready, then one send per client
     add_accept_request(&ring, fd);
     while (true) {
         int ret = io_uring_wait_cqe(&ring, &cqe);
-        struct req_tag *tag = (struct req_tag *)cqe->user_data;
-        if (tag == NULL) {
-            // was a close operation
-            io_uring_cqe_seen(&ring, cqe);
-            continue;
-        }
         if (ret < 0) {
-            perror("io_uring_wait_cqe");
+            fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
             exit(1);
         }
-        if (cqe->res < 0) {
-            fprintf(stderr, "Async request failed: %s for event: %d\n",
-                    strerror(-cqe->res), tag->event_type);
-            // exit(1);
-        }
-        switch (tag->event_type) {
-        case ACCEPT: {
-            bool served = false;
-            int client_id = -1;
-            for (int i = 0; i < MAXN; i++) {
-                if (!online[i]) {
-                    client_fds[i] = cqe->res;
-                    online[i] = true;
-                    client_id = i;
-                    served = true;
-                    break;
-                }
-            }
-            if (served) {
-                add_recv_request(&ring, client_id, BUFLEN);
-            } else {
-                add_close_request(&ring, cqe->res);
-            }
-            add_accept_request(&ring, fd);
-            break;
-        }
-        case RECV:
-            if (!cqe->res) {
-                // read zero bytes, client disconnect
-                add_close_request(&ring, client_fds[tag->client_id]);
-                online[tag->client_id] = false;
-            } else {
-                tag->len = cqe->res;    // actual message length
-                broadcast_messages(&ring, tag);
-                add_recv_request(&ring, tag->client_id, BUFLEN);
-            }
-            free(tag->buf);
-            break;
-        case SEND:
-            // send completed, free the buffers
-            free(tag->buf);
-            break;
-        }
-        free(tag);
-        io_uring_cqe_seen(&ring, cqe);
+        do {
+            handle_completion(&ring, cqe, fd);
+            io_uring_cqe_seen(&ring, cqe);
+        } while (io_uring_peek_cqe(&ring, &cqe) == 0);
+        flush_sends(&ring);
     }
     return 0;
 }
@@ -0,0 +1,357 @@
+// the chat server of 3.cpp / 5.c on top of reactor.h: every line a client sends
+// goes to all other clients, prefixed with "Message: ". the application logic
+// is the same whatever the backend, so the backends can be compared directly
+//
+// clients on the same host can use -l path instead, a Unix socket that hands
+// them a shared memory channel (shm.h, shm_client.cpp); both kinds of client
+// are connections of the same reactor and see the same broadcasts
+//
+// with -H path the server can be replaced without dropping anybody: start the
+// new binary with -H path -R and it takes over the listening sockets, the
+// clients and their queued output from the running one (handoff.h), which
+// then exits. port and -l are inherited in that case
+//
+// a client that sends "/compress" receives compressed frames from then on
+// (frame.h, chat_client.cpp); a broadcast is compressed once and the same
+// frame queued for every such client. -z sets the zlib level, -t the size
+// below which messages go out uncompressed
+//
+// -m and -k limit what each client may send, in lines and kilobytes per
+// second. what a client sends over its limit is held back and passed on as
+// its allowance grows, and until then nothing more is read from it; nothing
+// is dropped, it waits in the socket buffer and TCP slows the sender down
+//
+// for latency under steady load: -c pins the loop to a CPU (best the one
+// taking the NIC's interrupts), -B sets SO_BUSY_POLL on the client sockets,
+// -s polls for up to that many µs before blocking
+//
+// usage: ./chat [-b select|epoll|uring] [-n max_clients] [-l socket_path] [-H handoff_path [-R]]
+//               [-c cpu] [-B busy_poll_us] [-s spin_us] [-z level] [-t threshold]
+//               [-m lines_per_sec] [-k kbytes_per_sec] [port]
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <signal.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "frame.h"
+#include "handoff.h"
+#include "reactor.h"
+#include "shm.h"
+
+using namespace std;
+
+const char header[] = "Message: ";
+const size_t header_len = sizeof(header) - 1;
+// a line longer than this is cut and sent in pieces
+const size_t max_line = 64 * 1024;
+
+// refills at rate per second up to a second's worth
+struct token_bucket {
+    double rate = 0;            // 0: no limit
+    double tokens = 0;
+    uint64_t last = 0;          // ns
+
+    void refill(uint64_t now) {
+        tokens = min(rate, tokens + (now - last) / 1e9 * rate);
+        last = now;
+    }
+    bool allows(double n) const { return rate <= 0 || tokens >= n; }
+    bool full() const { return rate <= 0 || tokens >= rate; }
+    // ms until n can be taken; more than a full bucket never fits, so only wait for it to fill
+    long wait(double n) const {
+        if (allows(n)) return 0;
+        return long((min(n, rate) - tokens) / rate * 1000) + 1;
+    }
+};
+
+struct client {
+    string partial;     // the start of a line whose newline has not arrived yet
+    bool compressed = false;    // asked for frames with /compress
+    token_bucket lines, bytes;
+    string backlog;     // read, but over the limit; passed on as the buckets refill
+    uint64_t resume_timer = 0;  // while it is pending the client is not read from
+};
+
+reactor *loop;
+int compress_level = Z_DEFAULT_COMPRESSION;
+size_t compress_threshold = 256;    // shorter messages are not worth compressing
+double line_rate = 0, byte_rate = 0;    // per client and second, 0: no limit
+
+// m as one frame: deflated if that makes it smaller
+msg_ref make_frame(const msg_ref &m) {
+    uLongf len = compressBound(m.size());
+    msg_ref f = make_message(FRAME_HEADER + std::max<size_t>(len, m.size()));
+    char kind = FRAME_DEFLATE;
+    if (m.size() < compress_threshold ||
+        compress2(reinterpret_cast<Bytef *>(f.data() + FRAME_HEADER), &len,
+                  reinterpret_cast<const Bytef *>(m.data()), m.size(), compress_level) != Z_OK ||
+        len >= m.size()) {
+        kind = FRAME_PLAIN;
+        len = m.size();
+        memcpy(f.data() + FRAME_HEADER, m.data(), len);
+    }
+    put_frame_header(f.data(), kind, len, m.size());
+    f.get()->len = FRAME_HEADER + len;
+    return f;
+}
+
+// one message for all peers: they share the buffer, nobody gets a copy. the
+// frame for compressed peers is made once, when the first of them comes up
+void broadcast(connection &from, msg_ref m) {
+    msg_ref frame;
+    loop->for_each([&](connection &peer) {
+        if (&peer == &from) return;
+        if (!static_cast<client *>(peer.user)->compressed) {
+            peer.send(m);
+            return;
+        }
+        if (!frame) frame = make_frame(m);
+        peer.send(frame);
+    });
+}
+
+// what is left of an unterminated line, with a newline added like before
+void flush_partial(connection &c, string &partial) {
+    partial += '\n';
+    msg_ref m = make_message(header_len + partial.size());
+    memcpy(m.data(), header, header_len);
+    memcpy(m.data() + header_len, partial.data(), partial.size());
+    m.get()->len = header_len + partial.size();
+    partial.clear();
+    broadcast(c, move(m));
+}
+
+// frames every complete line in data, together with what was left over from
+// the last read, into a single message
+void frame_lines(connection &c, const char *data, size_t len) {
+    client *cl = static_cast<client *>(c.user);
+    string &partial = cl->partial;
+    // "/compress" on a line of its own is for the server: handle what came
+    // before it, switch, then go on with the rest. it is looked for in the
+    // complete lines, the first one with the partial in front, so a request
+    // split across two reads is still found
+    const size_t req_len = sizeof(COMPRESS_REQUEST) - 1;
+    for (const char *line = data, *nl; (nl = static_cast<const char *>(memchr(line, '\n', data + len - line)));
+         line = nl + 1) {
+        size_t line_len = nl + 1 - line;
+        if (line == data) {
+            if (partial.size() + line_len != req_len || memcmp(partial.data(), COMPRESS_REQUEST, partial.size()) ||
+                memcmp(line, COMPRESS_REQUEST + partial.size(), line_len))
+                continue;
+            partial.clear();
+        } else {
+            if (line_len != req_len || memcmp(line, COMPRESS_REQUEST, req_len)) continue;
+            frame_lines(c, data, line - data);
+        }
+        if (!cl->compressed) {
+            c.send(COMPRESS_REPLY, sizeof(COMPRESS_REPLY) - 1);
+            cl->compressed = true;
+        }
+        frame_lines(c, nl + 1, data + len - nl - 1);
+        return;
+    }
+    const char *end = static_cast<const char *>(memrchr(data, '\n', len));
+    if (end == nullptr) {
+        partial.append(data, len);
+        if (partial.size() >= max_line) flush_partial(c, partial);
+        return;
+    }
+    ++end;
+    size_t lines = 0;
+    for (const char *p = data; p < end; ++p) lines += *p == '\n';
+    msg_ref m = make_message(lines * header_len + partial.size() + (end - data));
+    char *out = m.data();
+    const char *line = data;
+    while (line < end) {
+        const char *nl = static_cast<const char *>(memchr(line, '\n', end - line)) + 1;
+        memcpy(out, header, header_len);
+        out += header_len;
+        if (!partial.empty()) {
+            memcpy(out, partial.data(), partial.size());
+            out += partial.size();
+            partial.clear();
+        }
+        memcpy(out, line, nl - line);
+        out += nl - line;
+        line = nl;
+    }
+    m.get()->len = out - m.data();
+    partial.assign(end, data + len - end);
+    broadcast(c, move(m));
+}
+
+// passes on as much of data as the buckets allow, whole lines only except
+// for an unterminated rest; returns how much that was
+size_t admit(connection &c, const char *data, size_t len) {
+    client *cl = static_cast<client *>(c.user);
+    uint64_t now = now_ns();
+    cl->lines.refill(now);
+    cl->bytes.refill(now);
+    size_t n = 0, lines = 0;
+    while (n < len) {
+        const char *nl = static_cast<const char *>(memchr(data + n, '\n', len - n));
+        size_t next = nl ? nl - data + 1 : len;
+        size_t more = nl ? 1 : 0;
+        if (!cl->lines.allows(lines + more) || !cl->bytes.allows(next)) {
+            // a line bigger than the whole bucket would never fit: a full
+            // bucket lets it through and goes into debt
+            if (n == 0 && cl->bytes.full() && cl->lines.allows(more)) {
+                n = next;
+                lines = more;
+            }
+            break;
+        }
+        n = next;
+        lines += more;
+    }
+    cl->lines.tokens -= lines;
+    cl->bytes.tokens -= n;
+    if (n) frame_lines(c, data, n);
+    return n;
+}
+
+void release(connection &c);
+
+// stop reading until the next line of the backlog is within the limit
+void hold(connection &c) {
+    client *cl = static_cast<client *>(c.user);
+    c.pause_read();
+    if (cl->resume_timer) return;
+    const char *nl = static_cast<const char *>(memchr(cl->backlog.data(), '\n', cl->backlog.size()));
+    size_t next = nl ? nl - cl->backlog.data() + 1 : cl->backlog.size();
+    long wait = max(cl->lines.wait(nl ? 1 : 0), cl->bytes.wait(next));
+    uint64_t id = c.id();
+    cl->resume_timer = loop->add_timer(wait, [id] {
+        connection *c = loop->find(id);
+        if (c == nullptr) return;
+        static_cast<client *>(c->user)->resume_timer = 0;
+        release(*c);
+    });
+}
+
+// the backlog, as far as the buckets have refilled; read again once it is gone
+void release(connection &c) {
+    client *cl = static_cast<client *>(c.user);
+    cl->backlog.erase(0, admit(c, cl->backlog.data(), cl->backlog.size()));
+    if (cl->backlog.empty()) c.resume_read();
+    else hold(c);
+}
+
+// a client within its limit goes straight through; what is over it waits in
+// the backlog, and while there is one nothing more is read, so it holds at
+// most one read's worth and the rest stays in the socket buffer
+void on_data(connection &c, const char *data, size_t len) {
+    client *cl = static_cast<client *>(c.user);
+    if (line_rate <= 0 && byte_rate <= 0) {
+        frame_lines(c, data, len);
+        return;
+    }
+    if (cl->backlog.empty()) {
+        size_t n = admit(c, data, len);
+        data += n;
+        len -= n;
+        if (len == 0) return;
+    }
+    cl->backlog.append(data, len);
+    hold(c);
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-b select|epoll|uring] [-n max_clients] [-l socket_path] "
+                    "[-H handoff_path [-R]] [-c cpu] [-B busy_poll_us] [-s spin_us] "
+                    "[-z level] [-t threshold] [-m lines_per_sec] [-k kbytes_per_sec] [port]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *backend = "epoll";
+    const char *local = nullptr, *handoff = nullptr;
+    bool takeover = false;
+    long max_clients = 32;
+    int cpu = -1, busy_poll = 0, spin = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:l:H:Rc:B:s:z:t:m:k:")) != -1) {
+        switch (opt) {
+        case 'b': backend = optarg; break;
+        case 'n': max_clients = atol(optarg); break;
+        case 'l': local = optarg; break;
+        case 'H': handoff = optarg; break;
+        case 'R': takeover = true; break;
+        case 'c': cpu = atoi(optarg); break;
+        case 'B': busy_poll = atoi(optarg); break;
+        case 's': spin = atoi(optarg); break;
+        case 'z': compress_level = atoi(optarg); break;
+        case 't': compress_threshold = atol(optarg); break;
+        case 'm': line_rate = atof(optarg); break;
+        case 'k': byte_rate = atof(optarg) * 1024; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (takeover ? handoff == nullptr : optind >= argc) usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    reactor r(backend);
+    loop = &r;
+    r.max_connections = max_clients;
+    r.cpu = cpu;
+    r.busy_poll_us = busy_poll;
+    r.spin_us = spin;
+    handoff_hooks hooks;
+    // a half received line and the backlog move along with their connection,
+    // and whether it gets frames: flag, length of the line, line, backlog
+    hooks.save = [](connection &c) {
+        client *cl = static_cast<client *>(c.user);
+        uint64_t n = cl->partial.size();
+        return string(1, cl->compressed ? 'Z' : '-') + string(reinterpret_cast<char *>(&n), sizeof(n)) +
+               cl->partial + cl->backlog;
+    };
+    hooks.restore = [](connection &c, const string &state) {
+        client *cl = static_cast<client *>(c.user);
+        uint64_t n;
+        if (state.size() < 1 + sizeof(n)) return;
+        cl->compressed = state[0] == 'Z';
+        memcpy(&n, state.data() + 1, sizeof(n));
+        cl->partial = state.substr(1 + sizeof(n), n);
+        cl->backlog = state.substr(1 + sizeof(n) + n);
+        // passed on from the loop, once every peer has been taken over
+        if (!cl->backlog.empty()) hold(c);
+    };
+    r.on_open = [](connection &c) {
+        client *cl = new client;
+        cl->lines.rate = cl->lines.tokens = line_rate;
+        cl->bytes.rate = cl->bytes.tokens = byte_rate;
+        cl->lines.last = cl->bytes.last = now_ns();
+        c.user = cl;
+    };
+    r.on_data = on_data;
+    r.on_close = [](connection &c) {
+        client *cl = static_cast<client *>(c.user);
+        // the limit is for a client that stays, what it left behind goes out now
+        if (!cl->backlog.empty()) frame_lines(c, cl->backlog.data(), cl->backlog.size());
+        if (!cl->partial.empty()) flush_partial(c, cl->partial);
+        if (cl->resume_timer) loop->cancel_timer(cl->resume_timer);
+        delete cl;
+    };
+    if (takeover) {
+        if (!take_over(r, handoff, hooks)) return 1;
+    } else {
+        if (r.listen_tcp(atoi(argv[optind])) < 0) {
+            perror("listen");
+            return 1;
+        }
+        if (local && listen_local(r, local) < 0) {
+            perror(local);
+            return 1;
+        }
+    }
+    if (handoff && !serve_handoff(r, handoff, hooks)) {
+        perror(handoff);
+        return 1;
+    }
+    r.run();
+    return 0;
+}
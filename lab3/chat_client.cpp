@@ -0,0 +1,138 @@
+// a TCP client for chat that asks for compressed frames (frame.h): stdin goes
+// to the server, the inflated broadcasts go to stdout. like nc otherwise; it
+// prints how many bytes came over the wire and how many they stood for when
+// it is done
+//
+// usage: ./chat_client host port
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "frame.h"
+
+void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+int connect_to(const char *host, const char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        exit(1);
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s host port\n", argv[0]);
+        return 1;
+    }
+    int sock = connect_to(argv[1], argv[2]);
+    write_all(sock, COMPRESS_REQUEST, sizeof(COMPRESS_REQUEST) - 1);
+
+    // plain text up to and including the reply, frames after it
+    std::string in;
+    std::vector<char> text;
+    bool framed = false, in_open = true;
+    unsigned long long wire = 0, inflated = 0;
+    static char buf[65536];
+    while (true) {
+        struct pollfd pfd[2] = {
+            {sock, POLLIN, 0},
+            {STDIN_FILENO, short(in_open ? POLLIN : 0), 0},
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if (pfd[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n > 0) {
+                write_all(sock, buf, n);
+            } else {
+                in_open = false;
+                shutdown(sock, SHUT_WR);
+            }
+        }
+        if (!pfd[0].revents) continue;
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        wire += n;
+        in.append(buf, n);
+        size_t off = 0;
+        if (!framed) {
+            // the reply is a line of its own; a message that merely contains
+            // its text is not it. the lines before it are what the server
+            // sent before it saw the request
+            size_t line = 0, nl;
+            while (!framed && (nl = in.find('\n', line)) != std::string::npos) {
+                if (in.compare(line, nl + 1 - line, COMPRESS_REPLY) == 0) framed = true;
+                else line = nl + 1;
+            }
+            write_all(STDOUT_FILENO, in.data(), line);
+            if (!framed) {
+                in.erase(0, line);
+                continue;
+            }
+            off = line + sizeof(COMPRESS_REPLY) - 1;
+        }
+        while (in.size() - off >= FRAME_HEADER) {
+            const char *f = in.data() + off;
+            uint32_t len = get_be32(f + 1), raw_len = get_be32(f + 5);
+            if (in.size() - off < FRAME_HEADER + len) break;
+            const char *payload = f + FRAME_HEADER;
+            if (f[0] == FRAME_PLAIN) {
+                write_all(STDOUT_FILENO, payload, len);
+            } else {
+                text.resize(raw_len);
+                uLongf out_len = raw_len;
+                if (uncompress(reinterpret_cast<Bytef *>(text.data()), &out_len,
+                               reinterpret_cast<const Bytef *>(payload), len) != Z_OK) {
+                    fprintf(stderr, "bad frame\n");
+                    return 1;
+                }
+                write_all(STDOUT_FILENO, text.data(), out_len);
+            }
+            inflated += raw_len;
+            off += FRAME_HEADER + len;
+        }
+        in.erase(0, off);
+    }
+    fprintf(stderr, "%llu bytes received for %llu bytes of messages\n", wire, inflated);
+    return 0;
+}
@@ -0,0 +1,35 @@
+// the compressed mode of chat: a client that sends the line "/compress" gets
+// "Compression: deflate\n" back, and from then on everything it receives is
+// a sequence of frames, one per broadcast:
+//
+//   kind (1 byte) | payload length (4) | length once inflated (4) | payload
+//
+// lengths big endian. kind 'Z' is a zlib stream of the text, 'P' the text as
+// it is (short messages, or ones that do not get smaller). what the client
+// sends is never compressed
+#ifndef LAB3_FRAME_H
+#define LAB3_FRAME_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define FRAME_HEADER 9
+#define FRAME_PLAIN 'P'
+#define FRAME_DEFLATE 'Z'
+#define COMPRESS_REQUEST "/compress\n"
+#define COMPRESS_REPLY "Compression: deflate\n"
+
+inline void put_frame_header(char *p, char kind, uint32_t len, uint32_t raw_len) {
+    p[0] = kind;
+    for (int i = 0; i < 4; ++i) {
+        p[1 + i] = char(len >> (24 - 8 * i));
+        p[5 + i] = char(raw_len >> (24 - 8 * i));
+    }
+}
+
+inline uint32_t get_be32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 | u[3];
+}
+
+#endif
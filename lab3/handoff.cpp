@@ -0,0 +1,224 @@
+#include "handoff.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+namespace {
+
+// the wire format, on a SOCK_SEQPACKET socket: per listener and per connection
+// one message with a record and its fds, then the payload (transport state,
+// application state, queued output) in messages of at most CHUNK bytes
+enum record_kind : uint32_t { TCP_LISTENER, LOCAL_LISTENER, TCP_CONN, LOCAL_CONN, END };
+
+struct record {
+    uint32_t kind;
+    uint32_t nfds;
+    uint32_t closing;       // close() was called, only the output is left to send
+    uint32_t transport_len;
+    uint64_t app_len;
+    uint64_t output_len;
+};
+
+#define CHUNK 65536
+#define MAX_FDS 4
+
+bool send_record(int sock, const record &rec, const std::vector<int> &fds, const std::string &payload) {
+    struct iovec iov = {const_cast<record *>(&rec), sizeof(rec)};
+    char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(rec))) return false;
+    for (size_t off = 0; off < payload.size(); off += CHUNK) {
+        size_t n = std::min<size_t>(CHUNK, payload.size() - off);
+        if (send(sock, payload.data() + off, n, MSG_NOSIGNAL) != ssize_t(n)) return false;
+    }
+    return true;
+}
+
+bool recv_record(int sock, record &rec, std::vector<int> &fds, std::string &payload) {
+    struct iovec iov = {&rec, sizeof(rec)};
+    char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != ssize_t(sizeof(rec))) return false;
+    fds.clear();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        fds.resize(n);
+        memcpy(fds.data(), CMSG_DATA(cmsg), n * sizeof(int));
+    }
+    if (fds.size() != rec.nfds) return false;
+    size_t total = rec.transport_len + rec.app_len + rec.output_len;
+    payload.resize(total);
+    for (size_t off = 0; off < total;) {
+        ssize_t n = recv(sock, &payload[off], std::min<size_t>(CHUNK, total - off), 0);
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+bool hand_over(reactor &r, int sock, const handoff_hooks &hooks) {
+    std::string payload;
+    for (int fd : r.listening()) {
+        int domain = AF_INET;
+        socklen_t len = sizeof(domain);
+        getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+        record rec = {domain == AF_UNIX ? LOCAL_LISTENER : TCP_LISTENER, 1, 0, 0, 0, 0};
+        if (!send_record(sock, rec, {fd}, payload)) return false;
+    }
+    bool ok = true;
+    r.for_each([&](connection &c) {
+        if (!ok) return;
+        std::vector<int> fds = {c.fd()}, extra;
+        std::string state, app;
+        if (c.io) c.io->save(extra, state);
+        fds.insert(fds.end(), extra.begin(), extra.end());
+        if (hooks.save) app = hooks.save(c);
+        payload = state + app;
+        for (auto &p : c.out) payload.append(p.m.data() + p.off, p.m.size() - p.off);
+        record rec = {c.io ? LOCAL_CONN : TCP_CONN, uint32_t(fds.size()), c.closing,
+                      uint32_t(state.size()), app.size(), c.queued()};
+        ok = send_record(sock, rec, fds, payload);
+    });
+    record end = {END, 0, 0, 0, 0, 0};
+    char ack;
+    return ok && send_record(sock, end, {}, "") && recv(sock, &ack, 1, 0) == 1;
+}
+
+}
+
+bool serve_handoff(reactor &r, const char *path, const handoff_hooks &hooks) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    // a predecessor still bound to the path is done with it once we run
+    unlink(path);
+    // whoever connects gets every socket of the server: the path is created
+    // with mode 0600 (fchmod on a socket does not reach the file it binds),
+    // and a peer running as another user is turned away
+    mode_t old_mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(fd, 1) < 0 ||
+        !r.watch(fd, [&r, fd, hooks] {
+            int sock = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock < 0) return;
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+                fprintf(stderr, "handoff: refused a peer of another user\n");
+                close(sock);
+                return;
+            }
+            // io_uring may already hold data received for a connection
+            if (r.completion()) {
+                fprintf(stderr, "hot restart needs the select or epoll backend\n");
+                close(sock);
+                return;
+            }
+            // blocking from here on, but not forever: if the successor dies,
+            // this process just carries on
+            struct timeval tv = {5, 0};
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (hand_over(r, sock, hooks)) {
+                r.unwatch(fd);
+                close(fd);
+                r.detach();
+            } else {
+                perror("handoff");
+            }
+            close(sock);
+        })) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+bool take_over(reactor &r, const char *path, const handoff_hooks &hooks) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        if (sock >= 0) close(sock);
+        return false;
+    }
+    record rec;
+    std::vector<int> fds;
+    std::string payload;
+    size_t listeners = 0, conns = 0;
+    while (true) {
+        if (!recv_record(sock, rec, fds, payload)) {
+            // the old process keeps serving; whatever came over is useless now
+            fprintf(stderr, "%s: handoff broken off\n", path);
+            close(sock);
+            return false;
+        }
+        if (rec.kind == END) break;
+        if (rec.kind == TCP_LISTENER || rec.kind == LOCAL_LISTENER) {
+            if (rec.kind == TCP_LISTENER) r.add_listener(fds[0]);
+            else serve_local(r, fds[0]);
+            ++listeners;
+            continue;
+        }
+        connection *c;
+        if (rec.kind == LOCAL_CONN)
+            c = adopt_local(r, fds[0], std::vector<int>(fds.begin() + 1, fds.end()),
+                            payload.substr(0, rec.transport_len));
+        else
+            c = r.adopt(fds[0]);
+        if (c == nullptr) continue;
+        ++conns;
+        if (hooks.restore) hooks.restore(*c, payload.substr(rec.transport_len, rec.app_len));
+        if (rec.output_len)
+            c->send(payload.data() + rec.transport_len + rec.app_len, rec.output_len);
+        if (rec.closing) c->close();
+    }
+    // from this byte on the old process leaves the fds alone
+    char ack = 1;
+    bool ok = send(sock, &ack, 1, MSG_NOSIGNAL) == 1;
+    close(sock);
+    if (ok) fprintf(stderr, "took over %zu listeners and %zu connections\n", listeners, conns);
+    return ok;
+}
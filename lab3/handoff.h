@@ -0,0 +1,26 @@
+// hot restart of a reactor server. the running process listens on a Unix
+// socket; a new process started with the same path connects to it and receives
+// the listening sockets, every connection and the output still queued for it.
+// once the new process has everything it says so, and the old one stops
+// touching the fds and exits: clients keep their connections and lose nothing
+#ifndef LAB3_HANDOFF_H
+#define LAB3_HANDOFF_H
+
+#include <functional>
+#include <string>
+
+#include "reactor.h"
+
+struct handoff_hooks {
+    // application state of a connection, such as a half received line
+    std::function<std::string(connection &)> save;
+    std::function<void(connection &, const std::string &)> restore;
+};
+
+// hand everything to the first successor that connects to path; false if the
+// socket cannot be set up
+bool serve_handoff(reactor &r, const char *path, const handoff_hooks &hooks);
+// take over from the process serving path, before r.run(); false if that fails
+bool take_over(reactor &r, const char *path, const handoff_hooks &hooks);
+
+#endif
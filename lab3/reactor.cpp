@@ -0,0 +1,857 @@
+#include "reactor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ---- message pool ----
+
+#define MIN_CLASS_SHIFT 8   // 256 B
+#define NUM_CLASSES 13      // up to 1 MB
+#define POOL_KEEP 256       // blocks kept per class
+
+namespace {
+
+struct message_pool {
+    std::vector<message *> free_list[NUM_CLASSES];
+    ~message_pool() {
+        for (auto &list : free_list)
+            for (message *m : list) free(m);
+    }
+};
+
+thread_local message_pool pool;
+
+}
+
+msg_ref make_message(size_t cap) {
+    int cls = 0;
+    while (cls < NUM_CLASSES && (size_t(1) << (cls + MIN_CLASS_SHIFT)) < cap) ++cls;
+    message *m;
+    if (cls == NUM_CLASSES) {
+        cls = -1;
+        m = static_cast<message *>(malloc(sizeof(message) + cap));
+    } else if (!pool.free_list[cls].empty()) {
+        m = pool.free_list[cls].back();
+        pool.free_list[cls].pop_back();
+    } else {
+        cap = size_t(1) << (cls + MIN_CLASS_SHIFT);
+        m = static_cast<message *>(malloc(sizeof(message) + cap));
+    }
+    if (m == nullptr) {
+        perror("malloc");
+        exit(1);
+    }
+    if (cls >= 0) cap = size_t(1) << (cls + MIN_CLASS_SHIFT);
+    m->refs = 1;
+    m->size_class = cls;
+    m->len = 0;
+    m->cap = cap;
+    return msg_ref(m);
+}
+
+msg_ref make_message(const char *data, size_t len) {
+    msg_ref m = make_message(len);
+    memcpy(m.data(), data, len);
+    m.get()->len = len;
+    return m;
+}
+
+msg_ref::~msg_ref() {
+    if (m == nullptr || --m->refs > 0) return;
+    if (m->size_class >= 0 && pool.free_list[m->size_class].size() < POOL_KEEP)
+        pool.free_list[m->size_class].push_back(m);
+    else
+        free(m);
+}
+
+// ---- connection ----
+
+void connection::send(msg_ref m) {
+    if (dead || closing || m.size() == 0) return;
+    queued_bytes += m.size();
+    out.push_back({std::move(m), 0});
+    if (queued_bytes > r.max_queued) {
+        fprintf(stderr, "connection %lu: %zu bytes queued, dropping it\n", (unsigned long)id_, queued_bytes);
+        abort();
+        return;
+    }
+    r.mark_dirty(*this);
+}
+
+void connection::close() {
+    if (dead || closing) return;
+    closing = true;
+    if (out.empty() && !send_busy) abort();
+    else r.mark_dirty(*this);
+}
+
+void connection::abort() {
+    r.destroy(*this);
+}
+
+void connection::pause_read() {
+    if (dead || paused) return;
+    paused = true;
+    r.mark_dirty(*this);
+}
+
+void connection::resume_read() {
+    if (dead || !paused) return;
+    paused = false;
+    // signals that came in meanwhile have been consumed
+    if (io) io->again();
+    r.mark_dirty(*this);
+}
+
+int connection::gather(struct iovec *vec, int max) const {
+    int n = 0;
+    for (auto it = out.begin(); it != out.end() && n < max; ++it, ++n) {
+        vec[n].iov_base = it->m.data() + it->off;
+        vec[n].iov_len = it->m.size() - it->off;
+    }
+    return n;
+}
+
+void connection::consume(size_t n) {
+    queued_bytes -= n;
+    while (n > 0) {
+        pending &head = out.front();
+        size_t left = head.m.size() - head.off;
+        if (n < left) {
+            head.off += n;
+            return;
+        }
+        n -= left;
+        out.pop_front();
+    }
+}
+
+// ---- select ----
+
+namespace {
+
+// rebuilds the fd sets on every round; fds past FD_SETSIZE cannot be watched
+class select_poller : public poller {
+    reactor &r;
+    std::vector<int> listeners, watched;
+    std::vector<connection *> conns;
+public:
+    explicit select_poller(reactor &r) : r(r) {}
+    const char *name() const override { return "select"; }
+
+    bool add_listener(int fd) override {
+        if (fd >= FD_SETSIZE) return false;
+        listeners.push_back(fd);
+        return true;
+    }
+    bool watch(int fd) override {
+        if (fd >= FD_SETSIZE) return false;
+        watched.push_back(fd);
+        return true;
+    }
+    void unwatch(int fd) override {
+        watched.erase(std::find(watched.begin(), watched.end(), fd));
+    }
+    bool add(connection *c) override {
+        if (c->fd() >= FD_SETSIZE) return false;
+        conns.push_back(c);
+        return true;
+    }
+    void update(connection *) override {}
+    void remove(connection *c) override {
+        conns.erase(std::find(conns.begin(), conns.end(), c));
+    }
+
+    int wait(int timeout_ms) override {
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        int maxfd = -1;
+        for (int fd : listeners) {
+            FD_SET(fd, &rfds);
+            maxfd = std::max(maxfd, fd);
+        }
+        for (int fd : watched) {
+            FD_SET(fd, &rfds);
+            maxfd = std::max(maxfd, fd);
+        }
+        for (connection *c : conns) {
+            if (c->watch_input()) FD_SET(c->fd(), &rfds);
+            if (!c->out.empty() && !c->io) FD_SET(c->fd(), &wfds);
+            maxfd = std::max(maxfd, c->fd());
+        }
+        struct timeval tv, *tvp = nullptr;
+        if (timeout_ms >= 0) {
+            tv.tv_sec = timeout_ms / 1000;
+            tv.tv_usec = timeout_ms % 1000 * 1000;
+            tvp = &tv;
+        }
+        int n = select(maxfd + 1, &rfds, &wfds, nullptr, tvp);
+        if (n < 0) {
+            if (errno != EINTR) perror("select");
+            return 0;
+        }
+        for (int fd : listeners)
+            if (FD_ISSET(fd, &rfds)) r.accept_ready(fd);
+        // handlers may add or remove connections and watches, work on copies
+        std::vector<int> signalled;
+        for (int fd : watched)
+            if (FD_ISSET(fd, &rfds)) signalled.push_back(fd);
+        for (int fd : signalled) r.watch_ready(fd);
+        std::vector<connection *> ready;
+        for (connection *c : conns)
+            if (FD_ISSET(c->fd(), &rfds) || FD_ISSET(c->fd(), &wfds)) ready.push_back(c);
+        for (connection *c : ready) {
+            // a connection removed meanwhile is dead but not freed before the round ends
+            if (!c->dead && FD_ISSET(c->fd(), &wfds)) r.writable(*c);
+            if (!c->dead && FD_ISSET(c->fd(), &rfds)) r.readable(*c);
+        }
+        return n;
+    }
+};
+
+// ---- epoll ----
+
+// level triggered; EPOLLOUT is only registered while output is queued
+class epoll_poller : public poller {
+    reactor &r;
+    int epfd;
+    // listeners and watched fds are told apart from connections by the tag in data.u64
+    static const uint64_t LISTENER = 1, WATCH = 2;
+public:
+    explicit epoll_poller(reactor &r) : r(r) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+    }
+    ~epoll_poller() override { ::close(epfd); }
+    const char *name() const override { return "epoll"; }
+
+    bool add_listener(int fd) override {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = uint64_t(fd) << 2 | LISTENER;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    bool watch(int fd) override {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = uint64_t(fd) << 2 | WATCH;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    void unwatch(int fd) override {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    bool add(connection *c) override {
+        struct epoll_event ev;
+        ev.events = c->events = EPOLLIN;
+        ev.data.ptr = c;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd(), &ev) == 0;
+    }
+    void update(connection *c) override {
+        uint32_t want = (c->watch_input() ? uint32_t(EPOLLIN) : 0) | (c->out.empty() || c->io ? 0 : uint32_t(EPOLLOUT));
+        if (want == c->events) return;
+        struct epoll_event ev;
+        ev.events = c->events = want;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd(), &ev) < 0) perror("epoll_ctl");
+    }
+    void remove(connection *c) override {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd(), nullptr);
+    }
+#ifdef EPIOCSPARAMS
+    // since Linux 6.9 epoll_wait() itself can busy poll the NIC queues of the
+    // sockets it watches, without the net.core.busy_poll sysctl
+    bool busy_poll(int usecs) override {
+        struct epoll_params params;
+        memset(&params, 0, sizeof(params));
+        params.busy_poll_usecs = usecs;
+        params.busy_poll_budget = 8;
+        return ioctl(epfd, EPIOCSPARAMS, &params) == 0;
+    }
+#endif
+
+    int wait(int timeout_ms) override {
+        struct epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, timeout_ms);
+        if (n < 0) {
+            if (errno != EINTR) perror("epoll_wait");
+            return 0;
+        }
+        for (int i = 0; i < n; ++i) {
+            // pointers are 8-byte aligned, which leaves the low bits for the tags
+            if (events[i].data.u64 & LISTENER) {
+                r.accept_ready(int(events[i].data.u64 >> 2));
+                continue;
+            }
+            if (events[i].data.u64 & WATCH) {
+                r.watch_ready(int(events[i].data.u64 >> 2));
+                continue;
+            }
+            connection *c = static_cast<connection *>(events[i].data.ptr);
+            uint32_t ev = events[i].events;
+            // a paused connection still gets HUP and ERR, which would spin
+            if (!c->dead && ((ev & EPOLLERR) || ((ev & EPOLLHUP) && !c->reading()))) r.destroy(*c);
+            if (!c->dead && (ev & EPOLLOUT)) r.writable(*c);
+            if (!c->dead && (ev & (EPOLLIN | EPOLLHUP))) r.readable(*c);
+        }
+        return n;
+    }
+};
+
+// ---- io_uring ----
+
+#ifdef HAVE_LIBURING
+
+// completion based: one recv per reading connection and at most one sendmsg
+// per connection are in flight; a sendmsg carries the whole queue (up to
+// IOV_MAX pieces), and a short write just continues with the next one.
+// transports and watched fds get a one-shot poll that is re-armed after each event
+class uring_poller : public poller {
+    reactor &r;
+    struct io_uring ring;
+    struct listener {
+        int fd;
+        connection::op op{connection::op::ACCEPT, nullptr};
+    };
+    std::vector<std::unique_ptr<listener>> listeners;
+    struct watcher {
+        connection::op op{connection::op::WATCH, nullptr};
+        int fd;
+        bool live;
+    };
+    // a watcher is freed when its last poll completes, which may be after unwatch()
+    std::unordered_map<int, watcher *> watchers;
+    connection::op cancel_op{connection::op::CANCEL, nullptr};
+    static const size_t RECV_SIZE = 16384;
+
+    struct io_uring_sqe *sqe() {
+        struct io_uring_sqe *s = io_uring_get_sqe(&ring);
+        if (s == nullptr) {
+            io_uring_submit(&ring);
+            s = io_uring_get_sqe(&ring);
+        }
+        return s;
+    }
+    void accept(listener *l) {
+        struct io_uring_sqe *s = sqe();
+        io_uring_prep_accept(s, l->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        io_uring_sqe_set_data(s, &l->op);
+    }
+    void poll(int fd, connection::op *op) {
+        struct io_uring_sqe *s = sqe();
+        io_uring_prep_poll_add(s, fd, POLLIN);
+        io_uring_sqe_set_data(s, op);
+    }
+    void recv(connection *c) {
+        if (c->io) {
+            poll(c->fd(), &c->poll_op);
+            c->recv_busy = true;
+            ++c->inflight;
+            return;
+        }
+        if (!c->rbuf) c->rbuf = make_message(RECV_SIZE);
+        struct io_uring_sqe *s = sqe();
+        io_uring_prep_recv(s, c->fd(), c->rbuf.data(), c->rbuf.get()->cap, 0);
+        io_uring_sqe_set_data(s, &c->recv_op);
+        c->recv_busy = true;
+        ++c->inflight;
+    }
+    void send(connection *c) {
+        c->iov.resize(std::min<size_t>(c->out.size(), IOV_MAX));
+        memset(&c->msg, 0, sizeof(c->msg));
+        c->msg.msg_iov = c->iov.data();
+        c->msg.msg_iovlen = c->gather(c->iov.data(), int(c->iov.size()));
+        struct io_uring_sqe *s = sqe();
+        io_uring_prep_sendmsg(s, c->fd(), &c->msg, MSG_NOSIGNAL);
+        io_uring_sqe_set_data(s, &c->send_op);
+        c->send_busy = true;
+        ++c->inflight;
+    }
+
+public:
+    explicit uring_poller(reactor &r) : r(r) {
+        int err = io_uring_queue_init(1024, &ring, 0);
+        if (err < 0) {
+            fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-err));
+            exit(1);
+        }
+    }
+    ~uring_poller() override { io_uring_queue_exit(&ring); }
+    const char *name() const override { return "uring"; }
+    bool completion() const override { return true; }
+
+    bool add_listener(int fd) override {
+        listeners.emplace_back(new listener{fd});
+        accept(listeners.back().get());
+        return true;
+    }
+    bool watch(int fd) override {
+        watcher *w = new watcher;
+        w->fd = fd;
+        w->live = true;
+        watchers[fd] = w;
+        poll(fd, &w->op);
+        return true;
+    }
+    void unwatch(int fd) override {
+        auto it = watchers.find(fd);
+        if (it == watchers.end()) return;
+        it->second->live = false;
+        struct io_uring_sqe *s = sqe();
+        io_uring_prep_cancel(s, &it->second->op, 0);
+        io_uring_sqe_set_data(s, &cancel_op);
+        watchers.erase(it);
+    }
+    bool add(connection *c) override {
+        recv(c);
+        return true;
+    }
+    void update(connection *c) override {
+        if (c->watch_input() && !c->recv_busy) recv(c);
+        if (!c->out.empty() && !c->send_busy && !c->io) send(c);
+    }
+    void remove(connection *c) override {
+        // the requests hold their own reference to the socket; cancel them,
+        // the connection is freed when the last completion comes back
+        for (connection::op *op : {c->io ? &c->poll_op : &c->recv_op, &c->send_op}) {
+            if (!(op == &c->send_op ? c->send_busy : c->recv_busy)) continue;
+            struct io_uring_sqe *s = sqe();
+            io_uring_prep_cancel(s, op, 0);
+            io_uring_sqe_set_data(s, &cancel_op);
+        }
+    }
+
+    int wait(int timeout_ms) override {
+        struct io_uring_cqe *cqe;
+        struct __kernel_timespec ts, *tsp = nullptr;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+            tsp = &ts;
+        }
+        int err = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, tsp, nullptr);
+        if (err < 0) {
+            if (err != -ETIME && err != -EINTR) fprintf(stderr, "io_uring_wait: %s\n", strerror(-err));
+            return 0;
+        }
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            ++seen;
+            auto *op = static_cast<connection::op *>(io_uring_cqe_get_data(cqe));
+            int res = cqe->res;
+            switch (op->kind) {
+            case connection::op::CANCEL:
+                break;
+            case connection::op::ACCEPT: {
+                auto *l = reinterpret_cast<listener *>(reinterpret_cast<char *>(op) - offsetof(listener, op));
+                if (res >= 0) r.accepted(l->fd, res);
+                else if (res != -ECANCELED) fprintf(stderr, "accept: %s\n", strerror(-res));
+                accept(l);
+                break;
+            }
+            case connection::op::WATCH: {
+                auto *w = reinterpret_cast<watcher *>(op);
+                if (w->live) r.watch_ready(w->fd);
+                if (w->live) poll(w->fd, &w->op);
+                else delete w;
+                break;
+            }
+            case connection::op::POLL: {
+                connection *c = op->conn;
+                c->recv_busy = false;
+                --c->inflight;
+                if (c->dead) {
+                    if (c->inflight == 0) r.release(*c);
+                    break;
+                }
+                r.readable(*c);
+                // a paused transport is polled again by update() once it resumes
+                if (!c->dead && c->watch_input() && !c->recv_busy) recv(c);
+                break;
+            }
+            case connection::op::RECV: {
+                connection *c = op->conn;
+                c->recv_busy = false;
+                --c->inflight;
+                if (c->dead) {
+                    if (c->inflight == 0) r.release(*c);
+                    break;
+                }
+                r.received(*c, c->rbuf.data(), res);
+                if (!c->dead && c->reading() && !c->recv_busy) recv(c);
+                break;
+            }
+            case connection::op::SEND: {
+                connection *c = op->conn;
+                c->send_busy = false;
+                --c->inflight;
+                if (c->dead) {
+                    if (c->inflight == 0) r.release(*c);
+                    break;
+                }
+                r.sent(*c, res);
+                break;
+            }
+            }
+        }
+        io_uring_cq_advance(&ring, seen);
+        return seen;
+    }
+};
+
+#endif
+
+}
+
+std::unique_ptr<poller> make_poller(const char *name, reactor &r) {
+    if (!strcmp(name, "select")) return std::unique_ptr<poller>(new select_poller(r));
+    if (!strcmp(name, "epoll")) return std::unique_ptr<poller>(new epoll_poller(r));
+#ifdef HAVE_LIBURING
+    if (!strcmp(name, "uring")) return std::unique_ptr<poller>(new uring_poller(r));
+#endif
+    return nullptr;
+}
+
+// ---- reactor ----
+
+reactor::reactor(const char *backend) {
+    poll = make_poller(backend, *this);
+    if (!poll) {
+        fprintf(stderr, "unknown or unsupported backend: %s\n", backend);
+        exit(1);
+    }
+}
+
+reactor::~reactor() {
+    for (auto &entry : conns)
+        if (!entry.second->dead) ::close(entry.second->fd());
+    // transports unwatch their fds, while the rest of the reactor is still there
+    conns.clear();
+}
+
+int reactor::listen_tcp(int port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, backlog) < 0) {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        return -1;
+    }
+    add_listener(fd);
+    return fd;
+}
+
+void reactor::add_listener(int fd, std::function<void(int)> on_accept) {
+    if (!poll->add_listener(fd)) {
+        perror("add_listener");
+        exit(1);
+    }
+    listeners[fd] = std::move(on_accept);
+}
+
+std::vector<int> reactor::listening() const {
+    std::vector<int> fds;
+    for (auto &entry : listeners) fds.push_back(entry.first);
+    return fds;
+}
+
+connection *reactor::adopt(int fd, std::unique_ptr<transport> io) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (live >= max_connections) {
+        ::close(fd);
+        return nullptr;
+    }
+    if (busy_poll_us > 0 && !io && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0 &&
+        !busy_poll_warned) {
+        // raising it above net.core.busy_read takes CAP_NET_ADMIN
+        perror("SO_BUSY_POLL");
+        busy_poll_warned = true;
+    }
+    std::unique_ptr<connection> owned(new connection(*this, next_id++, fd));
+    connection *c = owned.get();
+    c->io = std::move(io);
+    if (!poll->add(c)) {
+        fprintf(stderr, "fd %d cannot be watched by %s\n", fd, poll->name());
+        ::close(fd);
+        return nullptr;
+    }
+    conns.emplace(c->id(), std::move(owned));
+    ++live;
+    if (on_open) on_open(*c);
+    return c;
+}
+
+connection *reactor::find(uint64_t id) {
+    auto it = conns.find(id);
+    return it == conns.end() || it->second->dead ? nullptr : it->second.get();
+}
+
+void reactor::accept_ready(int lfd) {
+    while (!detached) {
+        int fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            return;
+        }
+        accepted(lfd, fd);
+    }
+}
+
+void reactor::accepted(int lfd, int fd) {
+    auto it = listeners.find(lfd);
+    if (it != listeners.end() && it->second) it->second(fd);
+    else adopt(fd);
+}
+
+bool reactor::watch(int fd, std::function<void()> fn) {
+    if (!poll->watch(fd)) return false;
+    watchers[fd] = std::move(fn);
+    return true;
+}
+
+void reactor::unwatch(int fd) {
+    if (watchers.erase(fd)) poll->unwatch(fd);
+}
+
+void reactor::watch_ready(int fd) {
+    auto it = watchers.find(fd);
+    if (it == watchers.end() || detached) return;
+    // the callback may unwatch itself
+    std::function<void()> fn = it->second;
+    fn();
+}
+
+void reactor::readable(connection &c) {
+    static thread_local char buf[65536];
+    if (detached) return;
+    if (c.io) c.io->ready();
+    // a bounded number of reads, so one fast sender cannot starve the others
+    int round = 0;
+    for (; round < 16 && !c.dead && c.reading(); ++round) {
+        ssize_t n = c.io ? c.io->read(buf, sizeof(buf)) : recv(c.fd(), buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0 && errno == EINTR) continue;
+        received(c, buf, n);
+        // a short recv means the socket is drained; a transport is read until it says so
+        if (!c.io && n < ssize_t(sizeof(buf))) break;
+    }
+    if (!c.io || c.dead) return;
+    // stopped with input left: nothing will signal it again
+    if (round == 16 && c.reading()) c.io->again();
+    // a transport's signal may also mean there is room to write again
+    if (!c.out.empty()) writable(c);
+}
+
+void reactor::received(connection &c, const char *data, ssize_t n) {
+    // EOF or an error; what is still queued for this peer is dropped
+    if (n <= 0) {
+        destroy(c);
+        return;
+    }
+    if (on_data) on_data(c, data, size_t(n));
+}
+
+void reactor::writable(connection &c) {
+    if (detached) return;
+    struct iovec vec[IOV_MAX];
+    while (!c.out.empty()) {
+        int cnt = c.gather(vec, IOV_MAX);
+        ssize_t n = c.io ? c.io->write(vec, cnt) : writev(c.fd(), vec, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) destroy(c);
+            break;
+        }
+        c.consume(size_t(n));
+    }
+    if (c.dead) return;
+    if (c.out.empty() && c.closing) {
+        destroy(c);
+        return;
+    }
+    poll->update(&c);
+}
+
+void reactor::sent(connection &c, ssize_t n) {
+    if (n < 0) {
+        if (n != -EAGAIN && n != -EINTR) {
+            destroy(c);
+            return;
+        }
+        n = 0;
+    }
+    c.consume(size_t(n));
+    if (c.out.empty() && c.closing) destroy(c);
+    else poll->update(&c);
+}
+
+void reactor::mark_dirty(connection &c) {
+    if (c.dirty) return;
+    c.dirty = true;
+    dirty.push_back(&c);
+}
+
+void reactor::destroy(connection &c) {
+    if (c.dead) return;
+    c.dead = true;
+    poll->remove(&c);
+    ::close(c.fd_);
+    c.io.reset();
+    // an io_uring sendmsg in flight still points into the queued buffers;
+    // they go with the connection once its completion is back
+    if (!c.send_busy) c.out.clear();
+    c.queued_bytes = 0;
+    --live;
+    if (on_close) on_close(c);
+    // freed at the end of the round: the poller may still hold pointers to it
+    if (c.inflight == 0) graveyard.push_back(c.id());
+}
+
+void reactor::release(connection &c) {
+    graveyard.push_back(c.id());
+}
+
+void reactor::bury() {
+    for (uint64_t id : graveyard) conns.erase(id);
+    graveyard.clear();
+}
+
+// queued output goes out once per round, so everything a round produced for a
+// peer leaves in one writev (or sendmsg) instead of one syscall per message
+void reactor::flush() {
+    if (detached) return;
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        connection *c = dirty[i];
+        c->dirty = false;
+        if (c->dead) continue;
+        if ((!poll->completion() || c->io) && !c->out.empty()) writable(*c);
+        else if (c->closing && c->out.empty() && !c->send_busy) destroy(*c);
+        else poll->update(c);
+    }
+    dirty.clear();
+}
+
+uint64_t reactor::add_timer(long ms, std::function<void()> fn) {
+    uint64_t id = next_timer++;
+    timers.push_back({now_ns() + uint64_t(std::max(ms, 0L)) * 1000000, id});
+    std::push_heap(timers.begin(), timers.end(), std::greater<timer>());
+    timer_fns.emplace(id, std::move(fn));
+    return id;
+}
+
+// the heap entry stays behind and is skipped when it comes up
+void reactor::cancel_timer(uint64_t id) {
+    timer_fns.erase(id);
+}
+
+int reactor::next_timeout() {
+    while (!timers.empty() && !timer_fns.count(timers.front().id)) {
+        std::pop_heap(timers.begin(), timers.end(), std::greater<timer>());
+        timers.pop_back();
+    }
+    if (!dirty.empty()) return 0;
+    if (timers.empty()) return -1;
+    uint64_t now = now_ns();
+    if (timers.front().deadline <= now) return 0;
+    // round up, waking up early would just spin
+    return int(std::min<uint64_t>((timers.front().deadline - now + 999999) / 1000000, INT_MAX));
+}
+
+void reactor::run_timers() {
+    uint64_t now = now_ns();
+    while (!detached && !timers.empty() && timers.front().deadline <= now) {
+        uint64_t id = timers.front().id;
+        std::pop_heap(timers.begin(), timers.end(), std::greater<timer>());
+        timers.pop_back();
+        auto it = timer_fns.find(id);
+        if (it == timer_fns.end()) continue;
+        std::function<void()> fn = std::move(it->second);
+        timer_fns.erase(it);
+        fn();
+    }
+}
+
+void reactor::detach() {
+    detached = true;
+    running = false;
+    for (auto &entry : conns) {
+        entry.second->out.clear();
+        entry.second->queued_bytes = 0;
+    }
+}
+
+// poll without blocking before going to sleep, so that an event arriving
+// within spin_us is picked up without a wakeup. a spin that finds something
+// doubles the budget (up to spin_us), one that comes up empty halves it (down
+// to 1/16), so an idle loop soon sleeps right away again
+void reactor::spin(int timeout_ms) {
+    uint64_t start = now_ns(), budget = spin_budget;
+    if (timeout_ms >= 0) budget = std::min<uint64_t>(budget, uint64_t(timeout_ms) * 1000000);
+    do {
+        if (poll->wait(0) > 0) {
+            spin_budget = std::min<uint64_t>(spin_budget * 2, uint64_t(spin_us) * 1000);
+            return;
+        }
+    } while (now_ns() - start < budget);
+    spin_budget = std::max<uint64_t>(spin_budget / 2, uint64_t(spin_us) * 1000 / 16);
+    poll->wait(next_timeout());
+}
+
+void reactor::run() {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) perror("sched_setaffinity");
+    }
+    if (busy_poll_us > 0) poll->busy_poll(busy_poll_us);
+    spin_budget = uint64_t(spin_us) * 1000;
+    running = true;
+    while (running) {
+        flush();
+        bury();
+        int timeout = next_timeout();
+        if (spin_us > 0 && timeout != 0) spin(timeout);
+        else poll->wait(timeout);
+        run_timers();
+    }
+    flush();
+    bury();
+}
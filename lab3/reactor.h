@@ -0,0 +1,255 @@
+// a small single-threaded event loop shared by the lab3 chat servers.
+// the readiness (select, epoll) and completion (io_uring) models hide behind
+// one interface: the application only sees connections, messages and timers
+#ifndef LAB3_REACTOR_H
+#define LAB3_REACTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// reference counted, immutable once sent. a broadcast builds one message
+// and queues a reference to it on every connection instead of a copy each
+struct message {
+    int refs;
+    int size_class;     // free list it goes back to, -1 if it came from malloc
+    size_t len;         // bytes used
+    size_t cap;
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+class msg_ref {
+    message *m = nullptr;
+public:
+    msg_ref() = default;
+    explicit msg_ref(message *m) : m(m) {}
+    msg_ref(const msg_ref &o) : m(o.m) { if (m) ++m->refs; }
+    msg_ref(msg_ref &&o) noexcept : m(o.m) { o.m = nullptr; }
+    msg_ref &operator=(msg_ref o) { std::swap(m, o.m); return *this; }
+    ~msg_ref();
+    message *get() const { return m; }
+    char *data() const { return m->data(); }
+    size_t size() const { return m->len; }
+    explicit operator bool() const { return m != nullptr; }
+};
+
+// messages come from per size class free lists (256 B to 1 MB), so the steady
+// state of a busy server does no malloc at all. one pool per thread
+msg_ref make_message(size_t cap);
+msg_ref make_message(const char *data, size_t len);
+
+// CLOCK_MONOTONIC in ns, what the timers go by
+uint64_t now_ns();
+
+class reactor;
+class poller;
+
+// how the bytes of a connection move when it is not a plain socket (shm.h).
+// the connection's fd then only signals that something changed on the other
+// side, data to read or room to write, and is never polled for writability
+class transport {
+public:
+    virtual ~transport() {}
+    // the fd was signalled; consume the signal
+    virtual void ready() {}
+    // reading stopped before read() failed with EAGAIN: signal the fd again
+    virtual void again() {}
+    // recv() and writev() semantics, -1 with EAGAIN when nothing can be done now
+    virtual ssize_t read(char *buf, size_t len) = 0;
+    virtual ssize_t write(const struct iovec *vec, int cnt) = 0;
+    // for a hot restart (handoff.h): the fds besides the connection's own and
+    // whatever else the next process needs to rebuild it
+    virtual void save(std::vector<int> &fds, std::string &state) const = 0;
+};
+
+class connection {
+public:
+    uint64_t id() const { return id_; }
+    int fd() const { return fd_; }
+
+    // queue output; it is written, coalesced with whatever else is queued,
+    // once the current round of events has been handled
+    void send(msg_ref m);
+    void send(const char *data, size_t len) { send(make_message(data, len)); }
+    // close once the queued output has been written
+    void close();
+    // close now, dropping the queued output
+    void abort();
+    // stop / restart reading; the data stays in the socket buffer meanwhile,
+    // so TCP flow control pushes back on the sender
+    void pause_read();
+    void resume_read();
+    bool reading() const { return !paused; }
+    // whether the fd has to be watched for input; a transport's signals are
+    // also about room to write, so its fd is watched while paused as long as
+    // output is waiting, and otherwise left alone like a paused socket
+    bool watch_input() const { return !paused || (io && !out.empty()); }
+    size_t queued() const { return queued_bytes; }
+    bool closed() const { return dead; }
+
+    void *user = nullptr;   // for the application
+
+    // the rest is shared with the backends
+    struct pending {
+        msg_ref m;
+        size_t off;
+    };
+    // an io_uring request in flight, its address is the user_data
+    struct op {
+        enum kind_t { RECV, SEND, POLL, ACCEPT, WATCH, CANCEL } kind;
+        connection *conn;
+    };
+
+    reactor &r;
+    uint64_t id_;
+    int fd_;
+    std::unique_ptr<transport> io;    // null for a socket
+    std::deque<pending> out;
+    size_t queued_bytes = 0;
+    bool paused = false;
+    bool closing = false;   // close() called, waiting for the queue to drain
+    bool dead = false;      // closed, freed once no request refers to it
+    bool dirty = false;     // on the reactor's flush list
+    uint32_t events = 0;    // interest currently registered with epoll
+    // io_uring state: one recv and at most one send in flight
+    int inflight = 0;
+    bool recv_busy = false, send_busy = false;
+    op recv_op{op::RECV, this}, send_op{op::SEND, this}, poll_op{op::POLL, this};
+    msg_ref rbuf;
+    std::vector<struct iovec> iov;
+    struct msghdr msg;
+
+    connection(reactor &r, uint64_t id, int fd) : r(r), id_(id), fd_(fd) {}
+    // up to `max` iovecs describing the head of the queue
+    int gather(struct iovec *vec, int max) const;
+    // drop n written bytes from the head of the queue
+    void consume(size_t n);
+};
+
+// readiness or completion notification, see reactor.cpp for the implementations
+class poller {
+public:
+    virtual ~poller() {}
+    virtual const char *name() const = 0;
+    virtual bool add_listener(int fd) = 0;
+    // plain readiness for fds that are neither listeners nor connections
+    virtual bool watch(int fd) = 0;
+    virtual void unwatch(int fd) = 0;
+    virtual bool add(connection *c) = 0;
+    // interest may have changed: paused, resumed, output queued or drained
+    virtual void update(connection *c) = 0;
+    // the connection is going away; its fd is still open at this point
+    virtual void remove(connection *c) = 0;
+    // wait at most timeout_ms (-1: no limit) and hand the events to the
+    // reactor; returns how many there were
+    virtual int wait(int timeout_ms) = 0;
+    // let the wait itself busy poll the NIC for the given µs; false if it cannot
+    virtual bool busy_poll(int) { return false; }
+    // true if the poller does the I/O itself (io_uring)
+    virtual bool completion() const { return false; }
+};
+
+// "select", "epoll" or "uring"; nullptr if unknown or not compiled in
+std::unique_ptr<poller> make_poller(const char *name, reactor &r);
+
+class reactor {
+public:
+    // exits with a message if the backend cannot be set up, like the servers always did
+    explicit reactor(const char *backend = "epoll");
+    ~reactor();
+    const char *backend() const { return poll->name(); }
+    bool completion() const { return poll->completion(); }
+
+    // listen on INADDR_ANY:port, returns the listening fd or -1
+    int listen_tcp(int port, int backlog = 128);
+    // accepted sockets become connections, unless on_accept takes them
+    void add_listener(int fd, std::function<void(int)> on_accept = nullptr);
+    std::vector<int> listening() const;
+    // take over an already connected socket, or the signalling fd of a transport
+    connection *adopt(int fd, std::unique_ptr<transport> io = nullptr);
+    connection *find(uint64_t id);
+    template <class F> void for_each(F f) {
+        for (auto &entry : conns)
+            if (!entry.second->dead) f(*entry.second);
+    }
+    size_t size() const { return live; }
+
+    // call fn whenever fd is readable, until unwatch(fd), which has to come before close(fd)
+    bool watch(int fd, std::function<void()> fn);
+    void unwatch(int fd);
+
+    // run fn once after ms milliseconds; cancel with the returned id
+    uint64_t add_timer(long ms, std::function<void()> fn);
+    void cancel_timer(uint64_t id);
+
+    void run();
+    void stop() { running = false; }
+    // the fds now belong to another process (handoff.h): drop the queued
+    // output, touch no fd any more and leave run() at the end of this round
+    void detach();
+
+    std::function<void(connection &)> on_open;
+    std::function<void(connection &, const char *, size_t)> on_data;
+    std::function<void(connection &)> on_close;
+    size_t max_connections = SIZE_MAX;  // further clients are closed right after accept
+    size_t max_queued = 64 << 20;       // a reader this far behind is dropped
+    // latency knobs, read by run(): the CPU to pin the loop to, SO_BUSY_POLL
+    // for every socket adopted, and how long to poll before blocking (µs)
+    int cpu = -1;
+    int busy_poll_us = 0;
+    int spin_us = 0;
+
+    // entry points for the pollers
+    void accept_ready(int lfd);             // readiness: accept until EAGAIN
+    void accepted(int lfd, int fd);         // completion: one new socket
+    void watch_ready(int fd);
+    void readable(connection &c);           // readiness: recv until EAGAIN
+    void writable(connection &c);           // readiness: writev the queue
+    void received(connection &c, const char *data, ssize_t n);  // completion
+    void sent(connection &c, ssize_t n);    // completion
+    void release(connection &c);            // last io_uring request of a dead connection is done
+    void mark_dirty(connection &c);
+    void destroy(connection &c);
+
+private:
+    std::unique_ptr<poller> poll;
+    std::unordered_map<uint64_t, std::unique_ptr<connection>> conns;
+    std::vector<connection *> dirty;
+    std::vector<uint64_t> graveyard;
+    std::unordered_map<int, std::function<void()>> watchers;
+    std::unordered_map<int, std::function<void(int)>> listeners;
+    uint64_t next_id = 1;
+    size_t live = 0;
+    bool running = false;
+    bool detached = false;
+    bool busy_poll_warned = false;
+    uint64_t spin_budget = 0;       // ns, adapted by spin()
+
+    struct timer {
+        uint64_t deadline;  // CLOCK_MONOTONIC, ns
+        uint64_t id;
+        bool operator>(const timer &o) const { return deadline > o.deadline; }
+    };
+    std::vector<timer> timers;      // min-heap
+    std::unordered_map<uint64_t, std::function<void()>> timer_fns;
+    uint64_t next_timer = 1;
+
+    void flush();
+    int next_timeout();
+    void spin(int timeout_ms);
+    void run_timers();
+    void bury();
+};
+
+uint64_t now_ns();
+
+#endif
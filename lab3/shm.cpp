@@ -0,0 +1,182 @@
+#include "shm.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+namespace {
+
+// the connection's fd is the server's eventfd; the Unix socket stays open only
+// to tell when the client goes away, the memfd only for a hot restart
+class shm_transport : public transport {
+    reactor &r;
+    int sock, client_efd, memfd;
+    void *base;
+    size_t ring_size;
+    bool eof = false;
+public:
+    shm_endpoint ep;
+
+    shm_transport(reactor &r, int sock, int client_efd, int memfd, void *base, size_t ring_size)
+        : r(r), sock(sock), client_efd(client_efd), memfd(memfd), base(base), ring_size(ring_size) {}
+    ~shm_transport() override {
+        r.unwatch(sock);
+        close(sock);
+        close(client_efd);
+        close(memfd);
+        munmap(base, shm_region_size(ring_size));
+    }
+
+    void ready() override { ep.consume_signal(); }
+    void again() override { ep.signal_self(); }
+    // like a socket: what the client wrote before it left is still read, then EOF
+    ssize_t read(char *buf, size_t n) override {
+        ssize_t got = ep.read(buf, n);
+        return got < 0 && errno == EAGAIN && eof ? 0 : got;
+    }
+    ssize_t write(const struct iovec *vec, int cnt) override {
+        return ep.write(vec, cnt);
+    }
+
+    void save(std::vector<int> &fds, std::string &state) const override {
+        fds = {sock, client_efd, memfd};
+        state.assign(reinterpret_cast<const char *>(&ring_size), sizeof(ring_size));
+    }
+
+    void hang_up() {
+        eof = true;
+        r.unwatch(sock);
+        ep.signal_self();
+    }
+
+    // the Unix socket reaching EOF means the client has gone
+    bool watch(uint64_t id) {
+        return r.watch(sock, [this, id] {
+            char buf[256];
+            ssize_t n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR))) return;
+            if (r.find(id) != nullptr) hang_up();
+        });
+    }
+};
+
+void close_all(std::initializer_list<int> fds) {
+    for (int fd : fds)
+        if (fd >= 0) close(fd);
+}
+
+void accept_local(reactor &r, int sock, size_t ring_size) {
+    // full: closed before the handshake, the client sees it fail
+    if (r.size() >= r.max_connections) {
+        close(sock);
+        return;
+    }
+    size_t len = shm_region_size(ring_size);
+    int memfd = memfd_create("chat-shm", MFD_CLOEXEC);
+    int server_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    void *base = MAP_FAILED;
+    if (memfd < 0 || server_efd < 0 || client_efd < 0 || ftruncate(memfd, len) < 0 ||
+        (base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        perror("local client setup");
+        close_all({sock, memfd, server_efd, client_efd});
+        return;
+    }
+    auto *t = new shm_transport(r, sock, client_efd, memfd, base, ring_size);
+    shm_endpoint::create(base, ring_size);
+    t->ep.init(base, ring_size, true, server_efd, client_efd);
+
+    // the handshake: the parameters and the three fds in one message
+    shm_hello hello = {SHM_MAGIC, uint32_t(ring_size)};
+    struct iovec iov = {&hello, sizeof(hello)};
+    int fds[3] = {memfd, client_efd, server_efd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    // a fresh socket has room for this, it does not block
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != ssize_t(sizeof(hello))) {
+        perror("local client handshake");
+        close(server_efd);
+        delete t;
+        return;
+    }
+
+    connection *c = r.adopt(server_efd, std::unique_ptr<transport>(t));
+    if (c != nullptr && !t->watch(c->id())) c->abort();
+}
+
+}
+
+int listen_local(reactor &r, const char *path, size_t ring_size) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path) || (ring_size & (ring_size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    serve_local(r, fd, ring_size);
+    return fd;
+}
+
+void serve_local(reactor &r, int fd, size_t ring_size) {
+    r.add_listener(fd, [&r, ring_size](int sock) { accept_local(r, sock, ring_size); });
+}
+
+connection *adopt_local(reactor &r, int fd, const std::vector<int> &fds, const std::string &state) {
+    size_t ring_size;
+    void *base = MAP_FAILED;
+    if (fds.size() != 3 || state.size() != sizeof(ring_size)) {
+        errno = EINVAL;
+    } else {
+        memcpy(&ring_size, state.data(), sizeof(ring_size));
+        base = mmap(nullptr, shm_region_size(ring_size), PROT_READ | PROT_WRITE, MAP_SHARED, fds[2], 0);
+    }
+    if (base == MAP_FAILED) {
+        perror("local client handoff");
+        close(fd);
+        for (int f : fds) close(f);
+        return nullptr;
+    }
+    auto *t = new shm_transport(r, fds[0], fds[1], fds[2], base, ring_size);
+    // the rings already exist, only the view is set up again
+    t->ep.init(base, ring_size, true, fd, fds[1]);
+    connection *c = r.adopt(fd, std::unique_ptr<transport>(t));
+    if (c == nullptr) return nullptr;
+    if (!t->watch(c->id())) {
+        c->abort();
+        return nullptr;
+    }
+    // whatever the client wrote during the handoff is waiting in the ring
+    t->again();
+    return c;
+}
@@ -0,0 +1,20 @@
+// local clients of a reactor server, see shm_ring.h for the channel itself
+#ifndef LAB3_SHM_H
+#define LAB3_SHM_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "reactor.h"
+
+// listen on the Unix socket at path. every client that connects is handed a
+// shared memory channel and then shows up as a connection of the reactor like
+// a TCP client. returns the listening fd or -1
+int listen_local(reactor &r, const char *path, size_t ring_size = 1 << 20);
+// the same on an already listening socket
+void serve_local(reactor &r, int fd, size_t ring_size = 1 << 20);
+// rebuild a local connection from what transport::save() gave a previous process
+connection *adopt_local(reactor &r, int fd, const std::vector<int> &fds, const std::string &state);
+
+#endif
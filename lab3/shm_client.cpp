@@ -0,0 +1,121 @@
+// a chat client for the local transport (chat -l path): stdin goes to the
+// server and what the server sends goes to stdout, like nc does for the TCP
+// port. it exits when stdin ends and everything read from it has been handed
+// over, or when the server goes away
+//
+// usage: ./shm_client socket_path
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s socket_path\n", argv[0]);
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    // the handshake: ring size, then memfd, our eventfd and the server's
+    shm_hello hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (got != ssize_t(sizeof(hello)) || hello.magic != SHM_MAGIC || cmsg == nullptr ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "%s: not a chat server, or it is full\n", argv[1]);
+        return 1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    size_t len = shm_region_size(hello.ring_size);
+    void *base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fds[0]);
+    shm_endpoint ep;
+    ep.init(base, hello.ring_size, false, fds[1], fds[2]);
+
+    static char in[65536], out[65536];
+    size_t in_len = 0, in_off = 0;
+    bool in_open = true, server_open = true;
+    while (true) {
+        ssize_t n;
+        while ((n = ep.read(out, sizeof(out))) > 0) write_all(STDOUT_FILENO, out, n);
+        if (n < 0 && errno == EPROTO) {
+            perror("shm");
+            return 1;
+        }
+        if (!server_open) break;
+        if (in_off < in_len) {
+            struct iovec v = {in + in_off, in_len - in_off};
+            if ((n = ep.write(&v, 1)) > 0) {
+                in_off += n;
+                if (in_off == in_len) in_off = in_len = 0;
+                continue;
+            }
+            if (n < 0 && errno == EPROTO) {
+                perror("shm");
+                return 1;
+            }
+            // full: the server signals once it has made room
+        }
+        if (!in_open && in_len == 0) break;
+
+        struct pollfd pfd[3] = {
+            {ep.fd(), POLLIN, 0},
+            {sock, POLLIN, 0},
+            {STDIN_FILENO, short(in_open && in_len == 0 ? POLLIN : 0), 0},
+        };
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if (pfd[0].revents) ep.consume_signal();
+        // the server closed its end; show what it left in the ring, then stop
+        if (pfd[1].revents) server_open = false;
+        if (pfd[2].revents) {
+            n = read(STDIN_FILENO, in, sizeof(in));
+            if (n <= 0) in_open = false;
+            else in_len = n;
+        }
+    }
+    return 0;
+}
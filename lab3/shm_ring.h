@@ -0,0 +1,163 @@
+// the local transport of chat: two single-producer single-consumer byte rings
+// in a memfd, one per direction, plus an eventfd per side for wakeups. a local
+// client gets all of it from the server over a Unix socket (SCM_RIGHTS); after
+// that the data only moves through the shared memory. the rings carry the same
+// byte stream a TCP connection would, so the chat protocol does not change
+#ifndef LAB3_SHM_RING_H
+#define LAB3_SHM_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// sent by the server along with three fds: the memfd, the client's eventfd
+// (the client waits on it) and the server's (the client signals it)
+struct shm_hello {
+    uint32_t magic;
+    uint32_t ring_size;     // data bytes per direction, a power of two
+};
+
+#define SHM_MAGIC 0x6c616233
+
+struct shm_ring {
+    // positions only grow, the index into the data is pos & (size - 1)
+    alignas(64) std::atomic<uint64_t> head;     // advanced by the consumer
+    std::atomic<uint32_t> producer_waiting;     // the producer found it full
+    alignas(64) std::atomic<uint64_t> tail;     // advanced by the producer
+    std::atomic<uint32_t> consumer_waiting;     // the consumer found it empty
+};
+
+// layout of the memfd: a page with the header of ring 0 (server to client),
+// its data, then the same for ring 1 (client to server)
+#define SHM_HEADER 4096
+
+inline size_t shm_region_size(size_t ring_size) {
+    return 2 * (SHM_HEADER + ring_size);
+}
+
+// one side of the channel. a side that finds its input ring empty (or its
+// output ring full) sets the waiting flag and re-checks; the other side checks
+// the flag after it has moved its position and then signals the eventfd. the
+// seq_cst accesses on both sides make sure one of them sees the other, so no
+// wakeup gets lost and no signal is sent while nobody waits
+class shm_endpoint {
+    shm_ring *rx = nullptr, *tx = nullptr;
+    char *rx_data = nullptr, *tx_data = nullptr;
+    uint64_t size = 0;
+    int self_efd = -1, peer_efd = -1;
+
+    void signal_peer() {
+        eventfd_write(peer_efd, 1);
+    }
+
+    // the positions live in memory the peer can write. each one is loaded once
+    // and checked before any arithmetic on it, so a peer that scribbles over
+    // them makes the call fail with EPROTO instead of copying out of bounds
+    bool broken(uint64_t head, uint64_t tail) {
+        if (tail - head <= size) return false;
+        errno = EPROTO;
+        return true;
+    }
+
+public:
+    // set up the rings in a fresh mapping of the memfd, done by the server
+    static void create(void *base, size_t ring_size) {
+        char *ring0 = static_cast<char *>(base), *ring1 = ring0 + SHM_HEADER + ring_size;
+        // both sides start out waiting for input
+        (new (ring0) shm_ring())->consumer_waiting.store(1);
+        (new (ring1) shm_ring())->consumer_waiting.store(1);
+    }
+
+    // base is the mapping of the memfd
+    void init(void *base, size_t ring_size, bool server, int self, int peer) {
+        char *ring0 = static_cast<char *>(base), *ring1 = ring0 + SHM_HEADER + ring_size;
+        shm_ring *to_client = reinterpret_cast<shm_ring *>(ring0);
+        shm_ring *to_server = reinterpret_cast<shm_ring *>(ring1);
+        rx = server ? to_server : to_client;
+        tx = server ? to_client : to_server;
+        rx_data = reinterpret_cast<char *>(rx) + SHM_HEADER;
+        tx_data = reinterpret_cast<char *>(tx) + SHM_HEADER;
+        size = ring_size;
+        self_efd = self;
+        peer_efd = peer;
+    }
+
+    int fd() const { return self_efd; }
+
+    // consume the signals sent to this side so far
+    void consume_signal() {
+        eventfd_t value;
+        eventfd_read(self_efd, &value);
+    }
+
+    // wake this side up again, for input it left in the ring
+    void signal_self() {
+        eventfd_write(self_efd, 1);
+    }
+
+    // recv() semantics minus EOF: -1 with EAGAIN when empty, and then the
+    // peer signals once it has written more; -1 with EPROTO if the ring is corrupt
+    ssize_t read(char *buf, size_t len) {
+        uint64_t head = rx->head.load(std::memory_order_acquire);
+        uint64_t tail = rx->tail.load(std::memory_order_acquire);
+        if (broken(head, tail)) return -1;
+        if (head == tail) {
+            rx->consumer_waiting.store(1);
+            tail = rx->tail.load();
+            if (broken(head, tail)) return -1;
+            if (head == tail) {
+                errno = EAGAIN;
+                return -1;
+            }
+            rx->consumer_waiting.store(0, std::memory_order_relaxed);
+        }
+        size_t n = std::min<uint64_t>(len, tail - head);
+        size_t at = head & (size - 1), first = std::min<size_t>(n, size - at);
+        memcpy(buf, rx_data + at, first);
+        memcpy(buf + first, rx_data, n - first);
+        rx->head.store(head + n);
+        if (rx->producer_waiting.load() && rx->producer_waiting.exchange(0)) signal_peer();
+        return n;
+    }
+
+    // writev() semantics: copies what fits, -1 with EAGAIN when the ring is
+    // full, and then the peer signals once it has made room; -1 with EPROTO
+    // if the ring is corrupt
+    ssize_t write(const struct iovec *vec, int cnt) {
+        uint64_t tail = tx->tail.load(std::memory_order_acquire);
+        uint64_t head = tx->head.load(std::memory_order_acquire);
+        if (broken(head, tail)) return -1;
+        if (tail - head == size) {
+            tx->producer_waiting.store(1);
+            head = tx->head.load();
+            if (broken(head, tail)) return -1;
+            if (tail - head == size) {
+                errno = EAGAIN;
+                return -1;
+            }
+            tx->producer_waiting.store(0, std::memory_order_relaxed);
+        }
+        size_t room = size - (tail - head), n = 0;
+        for (int i = 0; i < cnt && n < room; ++i) {
+            const char *src = static_cast<const char *>(vec[i].iov_base);
+            size_t len = std::min(vec[i].iov_len, room - n);
+            size_t at = (tail + n) & (size - 1), first = std::min<size_t>(len, size - at);
+            memcpy(tx_data + at, src, first);
+            memcpy(tx_data, src + first, len - first);
+            n += len;
+        }
+        tx->tail.store(tail + n);
+        if (tx->consumer_waiting.load() && tx->consumer_waiting.exchange(0)) signal_peer();
+        return n;
+    }
+};
+
+#endif